@@ -0,0 +1,379 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+#include <minizip/unzip.h>
+#include <minizip/zip.h>
+#include "util.h"
+#include "spool.h"
+#include "sha256.h"
+#include "archive.h"
+
+#define ARCHIVE_MAGIC "mdex-journal 2\n"
+#define ARCHIVE_CHUNK 16384
+#define LOCAL_MAGIC "PK\3\4"
+#define LOCAL_SIZE 30
+#define NO_KEY "-"
+
+static unsigned get16(const unsigned char *ptr)
+{
+	return (unsigned)ptr[0] | (unsigned)ptr[1] << 8;
+}
+
+static int write_zip(void *zip, const char *ptr, size_t size)
+{
+	return zipWriteInFileInZip(zip, ptr, (unsigned)size) ? ERROR : OK;
+}
+
+static char *concat(const char *path, const char *suffix)
+{
+	char *s = malloc(strlen(path) + strlen(suffix) + 1);
+	if (s)
+		strcat(strcpy(s, path), suffix);
+	return s;
+}
+
+static int set_names(archive_t *archive, const char *path)
+{
+	memset(archive, 0, sizeof(*archive));
+	archive->cursor = (size_t)-1;
+	if (!(archive->path = concat(path, "")) ||
+	    !(archive->part = concat(path, ".part")) ||
+	    !(archive->log = concat(path, ".journal")))
+		return ERROR;
+	return OK;
+}
+
+static int set_entry(archive_entry_t *entry, const char *name, const char *key)
+{
+	if (strlen(name) >= sizeof(entry->name) || strlen(key) >= sizeof(entry->key))
+		return ERROR;
+	strcpy(entry->name, name);
+	strcpy(entry->key, key);
+	return OK;
+}
+
+static int read_entry(FILE *journal, archive_entry_t *entry)
+{
+	int result = ERROR, pos;
+	char *line = NULL;
+	size_t size = 0;
+	ssize_t n = getline(&line, &size, journal);
+	if (n <= 0 || line[n - 1] != '\n' ||
+	    sscanf(line, "%d %lu %lu %lx %255s %n", &entry->method, &entry->csize,
+	           &entry->usize, &entry->crc, entry->key, &pos) != 5)
+		goto cleanup;
+	line[n - 1] = '\0';
+	if (!line[pos] || strlen(line + pos) >= sizeof(entry->name))
+		goto cleanup;
+	strcpy(entry->name, line + pos);
+	if (!strcmp(entry->key, NO_KEY))
+		entry->key[0] = '\0';
+	result = OK;
+cleanup:
+	free(line);
+	return result;
+}
+
+static int locate(FILE *part, const archive_entry_t *entry, long offset)
+{
+	unsigned char header[LOCAL_SIZE];
+	char name[sizeof(entry->name)];
+	size_t n = strlen(entry->name);
+	if (fseek(part, offset, SEEK_SET) ||
+	    fread(header, 1, sizeof(header), part) != sizeof(header) ||
+	    memcmp(header, LOCAL_MAGIC, 4) || get16(header + 26) != n ||
+	    fread(name, 1, n, part) != n || memcmp(name, entry->name, n) ||
+	    fseek(part, (long)get16(header + 28), SEEK_CUR))
+		return ERROR;
+	return OK;
+}
+
+static int inflate_crc(z_stream *stream, char *chunk, size_t size, unsigned long *crc)
+{
+	char plain[ARCHIVE_CHUNK];
+	int status;
+	stream->next_in = (Bytef *)chunk;
+	stream->avail_in = (uInt)size;
+	do {
+		stream->next_out = (Bytef *)plain;
+		stream->avail_out = sizeof(plain);
+		status = inflate(stream, Z_NO_FLUSH);
+		if (status != Z_OK && status != Z_STREAM_END && status != Z_BUF_ERROR)
+			return ERROR;
+		*crc = crc32(*crc, (const Bytef *)plain, (uInt)(sizeof(plain) - stream->avail_out));
+	} while (!stream->avail_out && status != Z_STREAM_END);
+	return status == Z_STREAM_END && stream->avail_in ? ERROR : OK;
+}
+
+static int copy_file(zipFile zip, FILE *part, const archive_entry_t *entry)
+{
+	char chunk[ARCHIVE_CHUNK];
+	unsigned long crc = crc32(0L, Z_NULL, 0), left = entry->csize;
+	size_t size;
+	int result = ERROR;
+	z_stream stream;
+	memset(&stream, 0, sizeof(stream));
+	if (entry->method && inflateInit2(&stream, -MAX_WBITS) != Z_OK)
+		return ERROR;
+	while (left) {
+		size = left < sizeof(chunk) ? (size_t)left : sizeof(chunk);
+		if (fread(chunk, 1, size, part) != size ||
+		    (zip && write_zip(zip, chunk, size)))
+			goto cleanup;
+		if (!entry->method)
+			crc = crc32(crc, (const Bytef *)chunk, (uInt)size);
+		else if (inflate_crc(&stream, chunk, size, &crc))
+			goto cleanup;
+		left -= size;
+	}
+	if (crc == entry->crc && (!entry->method || stream.total_out == entry->usize))
+		result = OK;
+cleanup:
+	if (entry->method)
+		inflateEnd(&stream);
+	return result;
+}
+
+static int open_entry(archive_t *archive, const archive_entry_t *entry)
+{
+	return zipOpenNewFileInZip2(archive->zip, entry->name, NULL, NULL, 0, NULL, 0,
+	                            entry->key[0] ? entry->key : NULL, entry->method, 0, 1) ? ERROR : OK;
+}
+
+static int close_entry(archive_t *archive, const archive_entry_t *entry)
+{
+	if (zipCloseFileInZipRaw(archive->zip, entry->usize, entry->crc))
+		return ERROR;
+	++archive->entries;
+	if (fprintf(archive->journal, "%d %lu %lu %08lx %s %s\n", entry->method,
+	            entry->csize, entry->usize, entry->crc,
+	            entry->key[0] ? entry->key : NO_KEY, entry->name) < 0 ||
+	    fflush(archive->journal))
+		return ERROR;
+	return OK;
+}
+
+static int walk(FILE *journal, FILE *part, archive_entries_t *entries)
+{
+	char magic[sizeof(ARCHIVE_MAGIC)];
+	archive_entry_t entry;
+	long offset = 0;
+	if (!fgets(magic, sizeof(magic), journal) || strcmp(magic, ARCHIVE_MAGIC))
+		return OK;
+	while (!read_entry(journal, &entry)) {
+		if (locate(part, &entry, offset))
+			break;
+		entry.offset = offset;
+		entry.index = entries->n;
+		entry.valid = 1;
+		offset = ftell(part) + (long)entry.csize;
+		if (copy_file(NULL, part, &entry))
+			break;
+		if (archive_entries_push(entries, &entry))
+			return ERROR;
+	}
+	return OK;
+}
+
+static int copy_part(archive_t *archive, const archive_entry_t *entry, const archive_entry_t *copy)
+{
+	if (locate(archive->recovered, entry, entry->offset) || open_entry(archive, copy))
+		return ERROR;
+	if (copy_file(archive->zip, archive->recovered, copy)) {
+		zipCloseFileInZipRaw(archive->zip, 0, 0);
+		return ERROR;
+	}
+	return close_entry(archive, copy);
+}
+
+static int copy_raw(archive_t *archive, const archive_entry_t *entry)
+{
+	char chunk[ARCHIVE_CHUNK];
+	int method, level, size;
+	if (unzOpenCurrentFile2(archive->source, &method, &level, 1))
+		return ERROR;
+	if (method != entry->method || open_entry(archive, entry)) {
+		unzCloseCurrentFile(archive->source);
+		return ERROR;
+	}
+	while ((size = unzReadCurrentFile(archive->source, chunk, (unsigned)sizeof(chunk))) > 0)
+		if (write_zip(archive->zip, chunk, (size_t)size))
+			break;
+	unzCloseCurrentFile(archive->source);
+	if (size) {
+		zipCloseFileInZipRaw(archive->zip, 0, 0);
+		return ERROR;
+	}
+	return close_entry(archive, entry);
+}
+
+int archive_scan(const char *path, archive_entries_t *entries)
+{
+	char chunk[ARCHIVE_CHUNK];
+	archive_entry_t entry;
+	unz_file_info info;
+	unzFile unzip;
+	sha256_t sha;
+	int result = ERROR, status, size;
+	if (!(unzip = unzOpen(path)))
+		return ERROR;
+	for (status = unzGoToFirstFile(unzip); status == UNZ_OK; status = unzGoToNextFile(unzip)) {
+		memset(&entry, 0, sizeof(entry));
+		if (unzGetCurrentFileInfo(unzip, &info, entry.name, sizeof(entry.name) - 1,
+		                          NULL, 0, entry.key, sizeof(entry.key) - 1))
+			goto cleanup;
+		entry.method = (int)info.compression_method;
+		entry.csize = info.compressed_size;
+		entry.usize = info.uncompressed_size;
+		entry.crc = info.crc;
+		entry.index = entries->n;
+		if (!unzOpenCurrentFile(unzip)) {
+			sha256_init(&sha);
+			while ((size = unzReadCurrentFile(unzip, chunk, (unsigned)sizeof(chunk))) > 0)
+				sha256_update(&sha, chunk, (size_t)size);
+			entry.valid = unzCloseCurrentFile(unzip) == UNZ_OK && !size &&
+			              sha256_match(&sha, entry.key, strlen(entry.key));
+		}
+		if (archive_entries_push(entries, &entry))
+			goto cleanup;
+	}
+	result = status == UNZ_END_OF_LIST_OF_FILE ? OK : ERROR;
+cleanup:
+	unzClose(unzip);
+	return result;
+}
+
+int archive_verify(const char *path, size_t *pages, size_t *damaged)
+{
+	size_t i;
+	archive_entries_t entries = archive_entries_make(0);
+	int result = archive_scan(path, &entries);
+	*pages = entries.n;
+	*damaged = 0;
+	for (i = 0; i < entries.n; ++i)
+		if (!entries.data[i].valid)
+			++*damaged;
+	archive_entries_free(&entries);
+	return result;
+}
+
+int archive_recover(const char *path, archive_entries_t *entries)
+{
+	archive_t archive;
+	FILE *journal = NULL, *part = NULL;
+	int result = ERROR;
+	if (set_names(&archive, path))
+		goto cleanup;
+	if ((journal = fopen(archive.log, "rb")) && (part = fopen(archive.part, "rb")) &&
+	    walk(journal, part, entries))
+		goto cleanup;
+	result = OK;
+cleanup:
+	if (part)
+		fclose(part);
+	if (journal)
+		fclose(journal);
+	free(archive.path);
+	free(archive.part);
+	free(archive.log);
+	return result;
+}
+
+int archive_open(archive_t *archive, const char *path, int mode)
+{
+	int result = ERROR;
+	if (set_names(archive, path))
+		goto cleanup;
+	if (mode == ARCHIVE_RESUME) {
+		if (!(archive->source = unzOpen(path)))
+			goto cleanup;
+	} else if (mode == ARCHIVE_RECOVER) {
+		if (!(archive->recovered = fopen(archive->part, "rb")))
+			goto cleanup;
+		remove(archive->part);
+		remove(archive->log);
+	}
+	if (!(archive->zip = zipOpen(archive->part, APPEND_STATUS_CREATE)) ||
+	    !(archive->journal = fopen(archive->log, "w")) ||
+	    fputs(ARCHIVE_MAGIC, archive->journal) == EOF ||
+	    fflush(archive->journal))
+		goto cleanup;
+	result = OK;
+cleanup:
+	if (result)
+		archive_abort(archive);
+	return result;
+}
+
+int archive_add(archive_t *archive, const char *name, const char *key, spool_t *spool, spool_t *packed)
+{
+	archive_entry_t entry;
+	if (set_entry(&entry, name, key))
+		return ERROR;
+	entry.method = packed ? Z_DEFLATED : 0;
+	entry.usize = (unsigned long)spool->size;
+	entry.csize = packed ? (unsigned long)packed->size : entry.usize;
+	entry.crc = spool->crc;
+	if (open_entry(archive, &entry))
+		return ERROR;
+	if (spool_copy(packed ? packed : spool, write_zip, archive->zip)) {
+		zipCloseFileInZipRaw(archive->zip, 0, 0);
+		return ERROR;
+	}
+	return close_entry(archive, &entry);
+}
+
+int archive_copy(archive_t *archive, const char *name, const char *key, const archive_entry_t *entry)
+{
+	archive_entry_t copy = *entry;
+	if (set_entry(&copy, name, key))
+		return ERROR;
+	if (archive->recovered)
+		return copy_part(archive, entry, &copy);
+	if (!archive->source)
+		return ERROR;
+	if (archive->cursor > entry->index) {
+		if (unzGoToFirstFile(archive->source))
+			return ERROR;
+		archive->cursor = 0;
+	}
+	for (; archive->cursor < entry->index; ++archive->cursor)
+		if (unzGoToNextFile(archive->source))
+			return ERROR;
+	return copy_raw(archive, &copy);
+}
+
+int archive_close(archive_t *archive)
+{
+	int result = ERROR;
+	zipFile zip = archive->zip;
+	archive->zip = NULL;
+	if (zipClose(zip, NULL) || rename(archive->part, archive->path))
+		goto cleanup;
+	remove(archive->log);
+	result = OK;
+cleanup:
+	archive_abort(archive);
+	return result;
+}
+
+void archive_abort(archive_t *archive)
+{
+	if (archive->zip)
+		zipClose(archive->zip, NULL);
+	if (archive->source)
+		unzClose(archive->source);
+	if (archive->recovered)
+		fclose(archive->recovered);
+	if (archive->journal)
+		fclose(archive->journal);
+	if (archive->part && !archive->entries) {
+		remove(archive->part);
+		remove(archive->log);
+	}
+	free(archive->path);
+	free(archive->part);
+	free(archive->log);
+	memset(archive, 0, sizeof(*archive));
+}
@@ -0,0 +1,43 @@
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+#include <stdio.h>
+#include <minizip/unzip.h>
+#include <minizip/zip.h>
+#include "util.h"
+#include "spool.h"
+
+#define ARCHIVE_CREATE 0
+#define ARCHIVE_RESUME 1
+#define ARCHIVE_RECOVER 2
+
+typedef struct archive_entry {
+	char name[256], key[256];
+	unsigned long csize, usize, crc;
+	size_t index;
+	long offset;
+	int method, valid;
+} archive_entry_t;
+
+#define VECT_NAME archive_entries
+#define VECT_ELEM archive_entry_t
+#include "vect.h"
+
+typedef struct archive {
+	zipFile zip;
+	unzFile source;
+	FILE *journal, *recovered;
+	char *path, *part, *log;
+	size_t entries, cursor;
+} archive_t;
+
+int archive_scan(const char *path, archive_entries_t *entries);
+int archive_verify(const char *path, size_t *pages, size_t *damaged);
+int archive_recover(const char *path, archive_entries_t *entries);
+int archive_open(archive_t *archive, const char *path, int mode);
+int archive_add(archive_t *archive, const char *name, const char *key, spool_t *spool, spool_t *packed);
+int archive_copy(archive_t *archive, const char *name, const char *key, const archive_entry_t *entry);
+int archive_close(archive_t *archive);
+void archive_abort(archive_t *archive);
+
+#endif
@@ -0,0 +1,99 @@
+#include <stdlib.h>
+#include <string.h>
+#include "arena.h"
+
+arena_t arena_make(void)
+{
+	arena_t arena = {0};
+	return arena;
+}
+
+void arena_free(arena_t *arena)
+{
+	arena_block_t *block;
+	while ((block = arena->blocks)) {
+		arena->blocks = block->next;
+		free(block);
+	}
+	free((void *)arena->table);
+	*arena = arena_make();
+}
+
+char *arena_alloc(arena_t *arena, size_t size)
+{
+	arena_block_t *block;
+	size_t n;
+	if (arena->blocks && arena->size - arena->used >= size) {
+		arena->used += size;
+		return (char *)(arena->blocks + 1) + arena->used - size;
+	}
+	n = size > ARENA_BLOCK / 4 ? size : ARENA_BLOCK;
+	if (!(block = malloc(sizeof(*block) + n)))
+		return NULL;
+	if (n == size && arena->blocks) {
+		block->next = arena->blocks->next;
+		arena->blocks->next = block;
+		return (char *)(block + 1);
+	}
+	block->next = arena->blocks;
+	arena->blocks = block;
+	arena->size = n;
+	arena->used = size;
+	return (char *)(block + 1);
+}
+
+char *arena_strdup(arena_t *arena, const char *ptr, size_t size)
+{
+	char *str = arena_alloc(arena, size + 1);
+	if (!str)
+		return NULL;
+	memcpy(str, ptr, size);
+	str[size] = '\0';
+	return str;
+}
+
+static size_t hash(const char *ptr, size_t size)
+{
+	size_t h = 2166136261u;
+	while (size--)
+		h = (h ^ (unsigned char)*ptr++) * 16777619u;
+	return h;
+}
+
+static const char **slot(const char **table, size_t slots, const char *ptr, size_t size)
+{
+	size_t i = hash(ptr, size) & (slots - 1);
+	for (; table[i]; i = (i + 1) & (slots - 1))
+		if (!strncmp(table[i], ptr, size) && !table[i][size])
+			break;
+	return &table[i];
+}
+
+static int grow(arena_t *arena)
+{
+	size_t i, slots = arena->slots ? 2 * arena->slots : 64;
+	const char **table = calloc(slots, sizeof(*table));
+	if (!table)
+		return ERROR;
+	for (i = 0; i < arena->slots; ++i)
+		if (arena->table[i])
+			*slot(table, slots, arena->table[i], strlen(arena->table[i])) = arena->table[i];
+	free((void *)arena->table);
+	arena->table = table;
+	arena->slots = slots;
+	return OK;
+}
+
+const char *arena_intern(arena_t *arena, const char *ptr, size_t size)
+{
+	const char **entry;
+	if (2 * (arena->count + 1) > arena->slots && grow(arena))
+		return NULL;
+	entry = slot(arena->table, arena->slots, ptr, size);
+	if (!*entry) {
+		if (!(*entry = arena_strdup(arena, ptr, size)))
+			return NULL;
+		++arena->count;
+	}
+	return *entry;
+}
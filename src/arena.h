@@ -0,0 +1,25 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include "defs.h"
+
+#define ARENA_BLOCK 16384
+
+typedef struct arena_block {
+	struct arena_block *next;
+} arena_block_t;
+
+typedef struct arena {
+	arena_block_t *blocks;
+	size_t used, size;
+	const char **table;
+	size_t slots, count;
+} arena_t;
+
+arena_t arena_make(void);
+void arena_free(arena_t *arena);
+char *arena_alloc(arena_t *arena, size_t size);
+char *arena_strdup(arena_t *arena, const char *ptr, size_t size);
+const char *arena_intern(arena_t *arena, const char *ptr, size_t size);
+
+#endif
@@ -0,0 +1,79 @@
+#include <stdlib.h>
+#include <ctype.h>
+#include <time.h>
+#include "util.h"
+#include "bandwidth.h"
+
+#define BANDWIDTH_WINDOWS 16
+
+typedef struct window {
+	unsigned from, to;
+	double limit;
+} window_t;
+
+static window_t windows[BANDWIDTH_WINDOWS];
+static unsigned count;
+static double standard;
+
+static const char *parse_limit(const char *spec, double *limit)
+{
+	char *end;
+	*limit = strtod(spec, &end);
+	if (end == spec || *limit < 0.0)
+		return NULL;
+	switch (toupper((unsigned char)*end)) {
+	case 'G': *limit *= 1024.0; /* fallthrough */
+	case 'M': *limit *= 1024.0; /* fallthrough */
+	case 'K': *limit *= 1024.0; ++end; break;
+	}
+	return end;
+}
+
+static const char *parse_time(const char *spec, unsigned *minutes)
+{
+	char *end;
+	unsigned long hours = strtoul(spec, &end, 10), mins;
+	if (end == spec || *end != ':' || hours > 24)
+		return NULL;
+	spec = end + 1;
+	mins = strtoul(spec, &end, 10);
+	if (end == spec || mins > 59 || hours * 60 + mins > 24 * 60)
+		return NULL;
+	*minutes = (unsigned)(hours * 60 + mins);
+	return end;
+}
+
+int bandwidth_parse(const char *spec)
+{
+	window_t *window;
+	count = 0;
+	if (!(spec = parse_limit(spec, &standard)))
+		return ERROR;
+	while (*spec == ',') {
+		if (count == BANDWIDTH_WINDOWS)
+			return ERROR;
+		window = &windows[count++];
+		if (!(spec = parse_time(spec + 1, &window->from)) || *spec != '-' ||
+		    !(spec = parse_time(spec + 1, &window->to)) || *spec != '=' ||
+		    !(spec = parse_limit(spec + 1, &window->limit)))
+			return ERROR;
+	}
+	return *spec ? ERROR : OK;
+}
+
+double bandwidth_limit(time_t now)
+{
+	unsigned i, minutes;
+	struct tm tm;
+	if (!count || !localtime_r(&now, &tm))
+		return standard;
+	minutes = (unsigned)(tm.tm_hour * 60 + tm.tm_min);
+	for (i = 0; i < count; ++i) {
+		const window_t *window = &windows[i];
+		if (window->from <= window->to ?
+		    minutes >= window->from && minutes < window->to :
+		    minutes >= window->from || minutes < window->to)
+			return window->limit;
+	}
+	return standard;
+}
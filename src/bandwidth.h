@@ -0,0 +1,10 @@
+#ifndef BANDWIDTH_H
+#define BANDWIDTH_H
+
+#include <time.h>
+#include "util.h"
+
+int bandwidth_parse(const char *spec);
+double bandwidth_limit(time_t now);
+
+#endif
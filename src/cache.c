@@ -0,0 +1,179 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <zlib.h>
+#include "util.h"
+#include "cache.h"
+
+#define CACHE_MAGIC "mdex-cache 1"
+#define CACHE_CHUNK 16384
+
+static buffer_t root;
+
+int cache_init(const char *dir)
+{
+	const char *base;
+	root = buffer_make(0);
+	if (dir) {
+		if (buffer_append(&root, dir))
+			goto error;
+	} else if ((base = getenv("XDG_CACHE_HOME")) && *base) {
+		if (buffer_append(&root, base) ||
+		    buffer_append(&root, "/mdex"))
+			goto error;
+	} else if ((base = getenv("HOME")) && *base) {
+		if (buffer_append(&root, base) ||
+		    buffer_append(&root, "/.cache/mdex"))
+			goto error;
+	} else {
+		goto error;
+	}
+	if (make_dirs(root.data))
+		goto error;
+	return OK;
+error:
+	buffer_free(&root);
+	return ERROR;
+}
+
+void cache_free(void)
+{
+	buffer_free(&root);
+}
+
+static unsigned long hash_url(const char *url, unsigned long seed)
+{
+	unsigned long hash = seed;
+	while (*url)
+		hash = (hash ^ (unsigned char)*url++) * 16777619UL & 0xffffffffUL;
+	return hash;
+}
+
+static size_t line_size(const char *url)
+{
+	return strlen(url) + sizeof(CACHE_MAGIC) + 1;
+}
+
+static int read_line(gzFile file, char *buf, int size)
+{
+	size_t n;
+	if (!gzgets(file, buf, size))
+		return ERROR;
+	n = strlen(buf);
+	if (!n || buf[n - 1] != '\n')
+		return ERROR;
+	buf[n - 1] = '\0';
+	return OK;
+}
+
+static int read_header(cache_t *cache, gzFile file, char *line, int size)
+{
+	if (read_line(file, line, size) || strcmp(line, CACHE_MAGIC) ||
+	    read_line(file, line, size) || strcmp(line, cache->url) ||
+	    read_line(file, cache->etag, sizeof(cache->etag)) ||
+	    read_line(file, cache->modified, sizeof(cache->modified)) ||
+	    read_line(file, line, size))
+		return ERROR;
+	cache->stamp = atol(line);
+	return OK;
+}
+
+cache_t *cache_open(const char *url)
+{
+	char name[24];
+	char *line;
+	gzFile file;
+	buffer_t path = buffer_make(0);
+	cache_t *cache;
+	if (!root.data || !(cache = calloc(1, sizeof(*cache))))
+		return NULL;
+	sprintf(name, "/%08lx%08lx", hash_url(url, 2166136261UL), hash_url(url, 84696351UL));
+	if (buffer_append(&path, root.data) ||
+	    buffer_append(&path, name) ||
+	    !(cache->url = strdup(url))) {
+		buffer_free(&path);
+		cache_close(cache);
+		return NULL;
+	}
+	cache->path = path.data;
+	if (!(file = gzopen(cache->path, "rb")))
+		return cache;
+	if ((line = malloc(line_size(url)))) {
+		cache->valid = !read_header(cache, file, line, (int)line_size(url));
+		free(line);
+	}
+	gzclose(file);
+	if (!cache->valid) {
+		cache->etag[0] = '\0';
+		cache->modified[0] = '\0';
+	}
+	return cache;
+}
+
+void cache_close(cache_t *cache)
+{
+	free(cache->path);
+	free(cache->url);
+	free(cache);
+}
+
+int cache_fresh(const cache_t *cache, long ttl)
+{
+	return cache->valid && (long)time(NULL) - cache->stamp < ttl;
+}
+
+int cache_load(const cache_t *cache, buffer_t *body)
+{
+	int n, result = ERROR;
+	char *line;
+	char chunk[CACHE_CHUNK];
+	size_t start = body->n;
+	cache_t header = *cache;
+	gzFile file;
+	if (!cache->valid || !(file = gzopen(cache->path, "rb")))
+		return ERROR;
+	if (!(line = malloc(line_size(cache->url))))
+		goto cleanup;
+	if (read_header(&header, file, line, (int)line_size(cache->url)))
+		goto cleanup;
+	while ((n = gzread(file, chunk, sizeof(chunk))) > 0)
+		if (buffer_strcpy(body, chunk, (size_t)n))
+			goto cleanup;
+	if (!n)
+		result = OK;
+cleanup:
+	if (result)
+		buffer_rewind(body, start);
+	free(line);
+	gzclose(file);
+	return result;
+}
+
+int cache_store(cache_t *cache, const char *data, size_t size)
+{
+	int result = ERROR;
+	gzFile file;
+	buffer_t tmp = buffer_make(0);
+	if (buffer_append(&tmp, cache->path) ||
+	    buffer_append(&tmp, ".tmp") ||
+	    !(file = gzopen(tmp.data, "wb")))
+		goto cleanup;
+	cache->stamp = (long)time(NULL);
+	if (gzprintf(file, "%s\n%s\n%s\n%s\n%ld\n", CACHE_MAGIC, cache->url,
+	             cache->etag, cache->modified, cache->stamp) <= 0 ||
+	    (size && gzwrite(file, data, (unsigned)size) != (int)size)) {
+		gzclose(file);
+		remove(tmp.data);
+		goto cleanup;
+	}
+	if (gzclose(file) != Z_OK || rename(tmp.data, cache->path)) {
+		remove(tmp.data);
+		goto cleanup;
+	}
+	cache->valid = 1;
+	result = OK;
+cleanup:
+	buffer_free(&tmp);
+	return result;
+}
@@ -0,0 +1,23 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include "util.h"
+
+typedef struct cache {
+	char *path;
+	char *url;
+	char etag[128];
+	char modified[64];
+	long stamp;
+	int valid;
+} cache_t;
+
+int cache_init(const char *dir);
+void cache_free(void);
+cache_t *cache_open(const char *url);
+void cache_close(cache_t *cache);
+int cache_fresh(const cache_t *cache, long ttl);
+int cache_load(const cache_t *cache, buffer_t *body);
+int cache_store(cache_t *cache, const char *data, size_t size);
+
+#endif
@@ -0,0 +1,125 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include "util.h"
+#include "cassette.h"
+
+#define CASSETTE_MAGIC "mdex-cassette 1\n"
+#define CASSETTE_CHUNK 16384
+
+static void track_free(track_t *track)
+{
+	free(track->url);
+}
+
+#define VECT_NAME tracks
+#define VECT_ELEM track_t
+#define VECT_FREE track_free
+#include "vect.h"
+
+static FILE *file;
+static tracks_t tracks;
+
+static int load_tracks(void)
+{
+	char *line = NULL;
+	size_t size = 0;
+	ssize_t n;
+	track_t track;
+	int pos;
+	if (getline(&line, &size, file) < 0 || strcmp(line, CASSETTE_MAGIC))
+		goto error;
+	while ((n = getline(&line, &size, file)) > 0) {
+		unsigned long head, body;
+		memset(&track, 0, sizeof(track));
+		if (line[n - 1] != '\n' ||
+		    sscanf(line, "%ld %d %ld %lu %lu %n", &track.status, &track.code,
+		           &track.time, &head, &body, &pos) != 5)
+			goto error;
+		line[n - 1] = '\0';
+		track.head = head;
+		track.body = body;
+		track.offset = ftell(file);
+		if (!(track.url = strdup(line + pos)))
+			goto error;
+		if (tracks_push(&tracks, &track)) {
+			track_free(&track);
+			goto error;
+		}
+		if (fseek(file, (long)(head + body), SEEK_CUR))
+			goto error;
+	}
+	free(line);
+	return OK;
+error:
+	free(line);
+	return ERROR;
+}
+
+int cassette_open(const char *path, int mode)
+{
+	tracks = tracks_make(0);
+	if (mode == CASSETTE_RECORD) {
+		if (!(file = fopen(path, "wb")))
+			return ERROR;
+		if (fputs(CASSETTE_MAGIC, file) < 0)
+			goto error;
+	} else {
+		if (!(file = fopen(path, "rb")))
+			return ERROR;
+		if (load_tracks())
+			goto error;
+	}
+	return OK;
+error:
+	cassette_close();
+	return ERROR;
+}
+
+void cassette_close(void)
+{
+	tracks_free(&tracks);
+	if (file) {
+		fclose(file);
+		file = NULL;
+	}
+}
+
+int cassette_record(const char *url, long status, int code, long time, const buffer_t *head, const buffer_t *body)
+{
+	if (fprintf(file, "%ld %d %ld %lu %lu %s\n", status, code, time,
+	            (unsigned long)head->n, (unsigned long)body->n, url) < 0 ||
+	    (head->n && fwrite(head->data, 1, head->n, file) != head->n) ||
+	    (body->n && fwrite(body->data, 1, body->n, file) != body->n))
+		return ERROR;
+	return OK;
+}
+
+track_t *cassette_find(const char *url)
+{
+	track_t *track;
+	tracks_iter_t it = tracks_iter(&tracks);
+	while (tracks_next(&track, &it)) {
+		if (!track->used && !strcmp(track->url, url)) {
+			track->used = 1;
+			return track;
+		}
+	}
+	return NULL;
+}
+
+int cassette_play(const track_t *track, long offset, size_t size, cassette_write_t write, void *data)
+{
+	char chunk[CASSETTE_CHUNK];
+	size_t n;
+	if (fseek(file, track->offset + offset, SEEK_SET))
+		return ERROR;
+	while (size) {
+		n = size < sizeof(chunk) ? size : sizeof(chunk);
+		if (fread(chunk, 1, n, file) != n ||
+		    write(data, chunk, n) != n)
+			return ERROR;
+		size -= n;
+	}
+	return OK;
+}
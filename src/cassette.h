@@ -0,0 +1,25 @@
+#ifndef CASSETTE_H
+#define CASSETTE_H
+
+#include "util.h"
+
+#define CASSETTE_RECORD 1
+#define CASSETTE_REPLAY 2
+
+typedef struct track {
+	char *url;
+	long status, time;
+	int code, used;
+	long offset;
+	size_t head, body;
+} track_t;
+
+typedef size_t (*cassette_write_t)(void *data, const char *ptr, size_t size);
+
+int cassette_open(const char *path, int mode);
+void cassette_close(void);
+int cassette_record(const char *url, long status, int code, long time, const buffer_t *head, const buffer_t *body);
+track_t *cassette_find(const char *url);
+int cassette_play(const track_t *track, long offset, size_t size, cassette_write_t write, void *data);
+
+#endif
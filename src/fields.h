@@ -0,0 +1,34 @@
+#include "json.h"
+
+#if !(defined(FIELDS_NAME) && defined(FIELDS_LIST))
+#error "You must define: FIELDS_NAME, FIELDS_LIST"
+#else
+
+#define FIELDS_(X) CAT(CAT(FIELDS_NAME, _), X)
+#define FIELDS FIELDS_(t)
+#define FIELDS_MEMBER(NAME, PATH) const json_t *NAME;
+#define FIELDS_PATH(NAME, PATH) PATH,
+#define FIELDS_ASSIGN(NAME, PATH) fields->NAME = found[i++];
+
+typedef struct FIELDS_NAME {
+	FIELDS_LIST(FIELDS_MEMBER)
+} FIELDS;
+
+static void FIELDS_(find)(const char *data, const json_t *token, FIELDS *fields)
+{
+	static const char *const paths[] = { FIELDS_LIST(FIELDS_PATH) };
+	const json_t *found[SIZEOF(paths)];
+	size_t i = 0;
+	json_fields(data, token, paths, found, SIZEOF(paths));
+	FIELDS_LIST(FIELDS_ASSIGN)
+}
+
+#endif
+
+#undef FIELDS_NAME
+#undef FIELDS_LIST
+#undef FIELDS_MEMBER
+#undef FIELDS_PATH
+#undef FIELDS_ASSIGN
+#undef FIELDS_
+#undef FIELDS
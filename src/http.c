@@ -1,73 +1,890 @@
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <time.h>
+#include <unistd.h>
 #include <curl/curl.h>
 #include "util.h"
+#include "rate.h"
+#include "retry.h"
+#include "cache.h"
+#include "cassette.h"
+#include "metrics.h"
+#include "bandwidth.h"
 #include "http.h"
 
 #define HTTP_USER_AGENT "mdex/1.0"
-#define REQS_PER_SECOND 5
-#define RETRY_DELAY 1000
-#define RETRY_COUNT 2
+#define API_RATE 5.0
+#define ATHOME_RATE (40.0 / 60.0)
+#define ATHOME_BURST 40.0
+#define API_RETRIES 4
+#define ATHOME_RETRIES 4
+#define IMAGE_RETRIES 6
+#define ATHOME_TTL 600
+#define POLL_TIMEOUT 1000
 
-static CURL *curl;
+#define VECT_NAME handles
+#define VECT_ELEM CURL *
+#define VECT_FREE curl_easy_cleanup
+#define VECT_PASS_VALUE
+#include "vect.h"
+
+#define VECT_NAME hosts
+#define VECT_ELEM char *
+#define VECT_FREE free
+#define VECT_PASS_VALUE
+#include "vect.h"
+
+static CURLM *multi;
+static CURLSH *share;
+static http_xfer_t warm;
+static unsigned flags;
+static hosts_t fallback;
+static handles_t idle;
+static http_xfer_t *pending;
+static http_xfer_t *paused;
+static unsigned active;
+static rate_t rates[HTTP_CLASSES];
+static unsigned budgets[HTTP_CLASSES] = {API_RETRIES, ATHOME_RETRIES, IMAGE_RETRIES};
+static double latency = 1.0;
+static int shaping;
+static double limit = -1.0;
+static rate_t bandwidth;
+static int watched = -1;
+
+static void copy_value(char *dest, size_t size, const char *value)
+{
+	if (strlen(value) < size)
+		strcpy(dest, value);
+}
+
+static int begin(http_xfer_t *xfer)
+{
+	xfer->started = 1;
+	if (!xfer->resumable || xfer->status >= 300)
+		return OK;
+	if (xfer->status == 206) {
+		if (xfer->range == (long)xfer->offset)
+			return OK;
+		xfer->restart = 1;
+		return ERROR;
+	}
+	if (xfer->offset) {
+		xfer->sink.rewind(xfer->sink.data);
+		xfer->offset = 0;
+	}
+	strcpy(xfer->validator, xfer->tag);
+	if (xfer->sink.validate)
+		xfer->sink.validate(xfer->sink.data, xfer->validator);
+	return OK;
+}
 
 static size_t callback(char *ptr, size_t size, size_t nmemb, void *data)
 {
-	buffer_t *buf = data;
-	return buffer_write(buf, ptr, nmemb);
+	http_xfer_t *xfer = data;
+	size_t n = nmemb;
+	if (shaping && xfer->handle && rate_wait(&bandwidth, mclock())) {
+		xfer->next = paused;
+		paused = xfer;
+		return CURL_WRITEFUNC_PAUSE;
+	}
+	if (!xfer->started && begin(xfer))
+		return 0;
+	if (xfer->status < 400) {
+		n = xfer->sink.write(xfer->sink.data, ptr, nmemb);
+		xfer->offset += n;
+	}
+	if (shaping)
+		rate_spend(&bandwidth, (double)n);
+	if ((flags & HTTP_RECORD) && buffer_write(&xfer->body, ptr, n) != n)
+		return 0;
+	return n;
+}
+
+static size_t buffer_sink_write(void *data, const char *ptr, size_t size)
+{
+	http_xfer_t *xfer = data;
+	size_t n = buffer_write(xfer->response, ptr, size);
+	if (n && xfer->tap.write)
+		xfer->tap.write(xfer->tap.data, ptr, n);
+	return n;
+}
+
+static void buffer_sink_rewind(void *data)
+{
+	http_xfer_t *xfer = data;
+	buffer_rewind(xfer->response, xfer->start);
+	if (xfer->tap.rewind)
+		xfer->tap.rewind(xfer->tap.data);
+}
+
+static const char *header_value(const char *line, const char *name)
+{
+	size_t n = strlen(name);
+	if (strncasecmp(line, name, n) || line[n] != ':')
+		return NULL;
+	for (line += n + 1; *line == ' ' || *line == '\t'; ++line);
+	return line;
 }
 
-int http_init(void)
+static long retry_after(const char *value)
 {
+	time_t date;
+	if (isdigit((unsigned char)*value))
+		return 1000 * atol(value);
+	if ((date = curl_getdate(value, NULL)) < 0)
+		return 0;
+	return 1000 * (long)(date - time(NULL));
+}
+
+static size_t header_callback(char *ptr, size_t size, size_t nmemb, void *data)
+{
+	http_xfer_t *xfer = data;
+	const char *value;
+	char line[256];
+	size_t n = nmemb < sizeof(line) - 1 ? nmemb : sizeof(line) - 1;
+	if ((flags & HTTP_RECORD) && buffer_write(&xfer->head, ptr, nmemb) != nmemb)
+		return 0;
+	memcpy(line, ptr, n);
+	while (n && (line[n - 1] == '\r' || line[n - 1] == '\n'))
+		--n;
+	line[n] = '\0';
+	if (!strncmp(line, "HTTP/", 5) && (value = strchr(line, ' '))) {
+		xfer->status = atol(value);
+		xfer->range = -1;
+		xfer->tag[0] = '\0';
+	} else if ((value = header_value(line, "ETag"))) {
+		if (xfer->cache)
+			copy_value(xfer->cache->etag, sizeof(xfer->cache->etag), value);
+		if (strncmp(value, "W/", 2))
+			copy_value(xfer->tag, sizeof(xfer->tag), value);
+	} else if ((value = header_value(line, "Last-Modified"))) {
+		if (xfer->cache)
+			copy_value(xfer->cache->modified, sizeof(xfer->cache->modified), value);
+		if (!*xfer->tag)
+			copy_value(xfer->tag, sizeof(xfer->tag), value);
+	} else if ((value = header_value(line, "Content-Range"))) {
+		if (!strncmp(value, "bytes */", 8))
+			xfer->range = atol(value + 8);
+		else if (!strncmp(value, "bytes ", 6))
+			xfer->range = atol(value + 6);
+	} else if ((value = header_value(line, "X-RateLimit-Remaining")))
+		xfer->remaining = atol(value);
+	else if ((value = header_value(line, "X-RateLimit-Retry-After")))
+		xfer->delay = 1000 * (atol(value) - (long)time(NULL));
+	else if ((value = header_value(line, "Retry-After")))
+		xfer->delay = retry_after(value);
+	return nmemb;
+}
+
+static CURL *handle_get(void)
+{
+	CURL *curl;
+	if (idle.n)
+		return idle.data[--idle.n];
+	if (!(curl = curl_easy_init()))
+		return NULL;
+	if (curl_easy_setopt(curl, CURLOPT_USERAGENT, HTTP_USER_AGENT) != CURLE_OK ||
+	    curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L) != CURLE_OK ||
+	    curl_easy_setopt(curl, CURLOPT_SHARE, share) != CURLE_OK ||
+	    curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, header_callback) != CURLE_OK ||
+	    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, callback) != CURLE_OK) {
+		curl_easy_cleanup(curl);
+		return NULL;
+	}
+	return curl;
+}
+
+static void handle_put(CURL *curl)
+{
+	if (handles_push(&idle, curl))
+		curl_easy_cleanup(curl);
+}
+
+static size_t url_host(const char *url, const char **host)
+{
+	const char *end = strstr(url, "://");
+	if (end)
+		url = end + 3;
+	for (end = url; *end && *end != '/' && *end != '?'; ++end);
+	*host = url;
+	return (size_t)(end - url);
+}
+
+static int is_fallback(const char *url)
+{
+	const char *host;
+	size_t i, size = url_host(url, &host);
+	for (i = 0; i < fallback.n; ++i)
+		if (strlen(fallback.data[i]) == size && !strncmp(fallback.data[i], host, size))
+			return 1;
+	return 0;
+}
+
+static void check_version(CURL *curl)
+{
+	long version = 0;
+	char *url = NULL, *host;
+	const char *ptr;
+	size_t size;
+	if (curl_easy_getinfo(curl, CURLINFO_HTTP_VERSION, &version) != CURLE_OK ||
+	    version == CURL_HTTP_VERSION_2_0 || version == CURL_HTTP_VERSION_3 ||
+	    curl_easy_getinfo(curl, CURLINFO_EFFECTIVE_URL, &url) != CURLE_OK ||
+	    !url || is_fallback(url))
+		return;
+	size = url_host(url, &ptr);
+	if ((host = strndup(ptr, size)) && hosts_push(&fallback, host))
+		free(host);
+}
+
+static int parse_retries(const char *list)
+{
+	char *end;
+	unsigned cls;
+	for (cls = 0; list && *list; ++cls) {
+		if (cls == HTTP_CLASSES)
+			return ERROR;
+		if (*list != ',') {
+			budgets[cls] = (unsigned)strtoul(list, &end, 10);
+			if (end == list)
+				return ERROR;
+			list = end;
+		}
+		if (*list == ',')
+			++list;
+		else if (*list)
+			return ERROR;
+	}
+	return OK;
+}
+
+static void schedule(http_xfer_t *xfer, long delay)
+{
+	xfer->track = NULL;
+	xfer->blocked = 0;
+	xfer->due = mclock() + delay;
+	xfer->next = pending;
+	pending = xfer;
+}
+
+static void reset(http_xfer_t *xfer)
+{
+	xfer->handle = NULL;
+	xfer->headers = NULL;
+	xfer->request = NULL;
+	xfer->cache = NULL;
+	xfer->offset = 0;
+	xfer->resumable = 0;
+	xfer->validator[0] = '\0';
+	xfer->url = NULL;
+	xfer->track = NULL;
+	xfer->head = buffer_make(0);
+	xfer->body = buffer_make(0);
+	memset(&xfer->tap, 0, sizeof(xfer->tap));
+}
+
+static void release(http_xfer_t *xfer)
+{
+	http_headers_free(&xfer->headers);
+	if (xfer->cache) {
+		cache_close(xfer->cache);
+		xfer->cache = NULL;
+	}
+	free(xfer->url);
+	xfer->url = NULL;
+	buffer_free(&xfer->head);
+	buffer_free(&xfer->body);
+}
+
+static void finish(http_xfer_t *xfer, int result)
+{
+	if (result && !(xfer->resumable && *xfer->validator))
+		xfer->sink.rewind(xfer->sink.data);
+	if (xfer->handle)
+		handle_put(xfer->handle);
+	release(xfer);
+	xfer->handle = NULL;
+	xfer->result = result;
+	xfer->done = 1;
+}
+
+int http_init(const http_args_t *args)
+{
+	if (parse_retries(args->retries)) {
+		puts("Failed to parse retry budgets");
+		return ERROR;
+	}
+	if (args->bandwidth && bandwidth_parse(args->bandwidth)) {
+		puts("Failed to parse bandwidth schedule");
+		return ERROR;
+	}
+	shaping = args->bandwidth != NULL;
+	retry_init();
+	flags = args->flags;
+	if (args->latency)
+		latency = atof(args->latency);
+	if (flags & (HTTP_RECORD | HTTP_REPLAY)) {
+		if (cassette_open(args->cassette, flags & HTTP_RECORD ? CASSETTE_RECORD : CASSETTE_REPLAY)) {
+			printf("Failed to open cassette: %s\n", args->cassette);
+			return ERROR;
+		}
+		flags |= HTTP_NOCACHE;
+	}
+	if (!(flags & HTTP_NOCACHE) && cache_init(args->cache)) {
+		if (args->cache) {
+			cassette_close();
+			printf("Failed to init response cache: %s\n", args->cache);
+			return ERROR;
+		}
+		puts("Response cache unavailable, continuing without it");
+		flags |= HTTP_NOCACHE;
+	}
 	if (curl_global_init(CURL_GLOBAL_ALL))
 		goto error;
-	if (!(curl = curl_easy_init()))
+	if (!(multi = curl_multi_init()))
 		goto cleanup_global;
-	if (curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_1_1) != CURLE_OK ||
-	    curl_easy_setopt(curl, CURLOPT_USERAGENT, HTTP_USER_AGENT) != CURLE_OK ||
-	    curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1) != CURLE_OK ||
-	    curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1) != CURLE_OK ||
-	    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, callback) != CURLE_OK)
-		goto cleanup_easy;
+	if (curl_multi_setopt(multi, CURLMOPT_PIPELINING,
+	                      flags & HTTP_MULTIPLEX ? CURLPIPE_MULTIPLEX : CURLPIPE_NOTHING) != CURLM_OK)
+		goto cleanup_multi;
+	if (!(share = curl_share_init()))
+		goto cleanup_multi;
+	if (curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS) != CURLSHE_OK ||
+	    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION) != CURLSHE_OK ||
+	    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT) != CURLSHE_OK)
+		goto cleanup_share;
+	warm.done = 1;
+	idle = handles_make(0);
+	fallback = hosts_make(0);
+	rates[HTTP_API] = rate_make(API_RATE, API_RATE);
+	rates[HTTP_ATHOME] = rate_make(ATHOME_RATE, ATHOME_BURST);
+	rates[HTTP_IMAGE] = rate_make(0.0, 0.0);
 	return OK;
-cleanup_easy:
-	curl_easy_cleanup(curl);
-	curl = NULL;
+cleanup_share:
+	curl_share_cleanup(share);
+	share = NULL;
+cleanup_multi:
+	curl_multi_cleanup(multi);
+	multi = NULL;
 cleanup_global:
 	curl_global_cleanup();
 error:
+	cache_free();
+	cassette_close();
 	puts("Failed to init libcurl");
 	return ERROR;
 }
 
 void http_free(void)
 {
-	if (curl) {
-		curl_easy_cleanup(curl);
-		curl = NULL;
+	while (pending)
+		http_cancel(pending);
+	http_cancel(&warm);
+	handles_free(&idle);
+	hosts_free(&fallback);
+	if (multi) {
+		curl_multi_cleanup(multi);
+		multi = NULL;
+	}
+	if (share) {
+		curl_share_cleanup(share);
+		share = NULL;
 	}
 	curl_global_cleanup();
+	cache_free();
+	cassette_close();
 }
 
-int http_get(const char *url, const http_headers_t *headers, const char *payload, buffer_t *response)
+static CURL *prepare(http_xfer_t *xfer, unsigned cls, const char *url, const http_headers_t *headers, const char *payload)
 {
-	size_t start = response->n;
-	unsigned retries = RETRY_COUNT;
+	CURL *curl = handle_get();
+	int h2 = (flags & HTTP_MULTIPLEX) && !is_fallback(url);
+	if (!curl)
+		return NULL;
 	if (curl_easy_setopt(curl, CURLOPT_URL, url) != CURLE_OK ||
-	    curl_easy_setopt(curl, CURLOPT_WRITEDATA, response) != CURLE_OK ||
+	    curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, h2 ? CURL_HTTP_VERSION_2TLS : CURL_HTTP_VERSION_1_1) != CURLE_OK ||
+	    curl_easy_setopt(curl, CURLOPT_PIPEWAIT, h2 ? 1L : 0L) != CURLE_OK ||
+	    curl_easy_setopt(curl, CURLOPT_PRIVATE, (void *)xfer) != CURLE_OK ||
+	    curl_easy_setopt(curl, CURLOPT_HEADERDATA, xfer) != CURLE_OK ||
+	    curl_easy_setopt(curl, CURLOPT_WRITEDATA, xfer) != CURLE_OK ||
 	    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers) != CURLE_OK ||
-	    curl_easy_setopt(curl, payload ? CURLOPT_POST : CURLOPT_HTTPGET, 1) != CURLE_OK ||
-	    (payload && curl_easy_setopt(curl, CURLOPT_POSTFIELDS, payload) != CURLE_OK))
+	    curl_easy_setopt(curl, CURLOPT_RANGE, NULL) != CURLE_OK ||
+	    curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, cls == HTTP_IMAGE ? NULL : "") != CURLE_OK ||
+	    curl_easy_setopt(curl, CURLOPT_NOBODY, 0L) != CURLE_OK ||
+	    curl_easy_setopt(curl, payload ? CURLOPT_POST : CURLOPT_HTTPGET, 1L) != CURLE_OK ||
+	    (payload && curl_easy_setopt(curl, CURLOPT_POSTFIELDS, payload) != CURLE_OK)) {
+		handle_put(curl);
+		return NULL;
+	}
+	return curl;
+}
+
+static int start(http_xfer_t *xfer, unsigned cls, const char *url, const http_headers_t *headers, const char *payload, const http_sink_t *sink)
+{
+	if ((flags & (HTTP_RECORD | HTTP_REPLAY)) && !(xfer->url = strdup(url)))
+		return ERROR;
+	if (!(flags & HTTP_REPLAY) && !(xfer->handle = prepare(xfer, cls, url, headers, payload)))
+		return ERROR;
+	xfer->sink = *sink;
+	xfer->cls = cls;
+	xfer->retries = budgets[cls];
+	xfer->done = 0;
+	xfer->result = ERROR;
+	schedule(xfer, 0);
+	return OK;
+}
+
+int http_stream(http_xfer_t *xfer, unsigned cls, const char *url, const http_headers_t *headers, const char *payload, const http_sink_t *sink)
+{
+	if (!payload)
+		return http_resume(xfer, cls, url, headers, sink, 0, "");
+	reset(xfer);
+	if (start(xfer, cls, url, headers, payload, sink)) {
+		release(xfer);
+		return ERROR;
+	}
+	return OK;
+}
+
+int http_resume(http_xfer_t *xfer, unsigned cls, const char *url, const http_headers_t *headers, const http_sink_t *sink, size_t offset, const char *validator)
+{
+	reset(xfer);
+	xfer->request = headers;
+	xfer->resumable = 1;
+	xfer->offset = offset;
+	copy_value(xfer->validator, sizeof(xfer->validator), validator);
+	if (start(xfer, cls, url, headers, NULL, sink)) {
+		release(xfer);
 		return ERROR;
-	while (curl_easy_perform(curl) != CURLE_OK) {
-		buffer_rewind(response, start);
-		if (!retries)
+	}
+	return OK;
+}
+
+static int conditional(http_xfer_t *xfer, const http_headers_t *headers)
+{
+	int result = ERROR;
+	const cache_t *cache = xfer->cache;
+	buffer_t line = buffer_make(0);
+	for (; headers; headers = headers->next)
+		if (http_headers_push(&xfer->headers, headers->data))
+			goto cleanup;
+	if (*cache->etag)
+		if (buffer_append(&line, "If-None-Match: ") ||
+		    buffer_append(&line, cache->etag) ||
+		    http_headers_push(&xfer->headers, line.data))
+			goto cleanup;
+	buffer_rewind(&line, 0);
+	if (*cache->modified)
+		if (buffer_append(&line, "If-Modified-Since: ") ||
+		    buffer_append(&line, cache->modified) ||
+		    http_headers_push(&xfer->headers, line.data))
+			goto cleanup;
+	result = OK;
+cleanup:
+	buffer_free(&line);
+	return result;
+}
+
+int http_start(http_xfer_t *xfer, unsigned cls, const char *url, const http_headers_t *headers, const char *payload, buffer_t *response, const http_sink_t *tap)
+{
+	http_sink_t sink;
+	sink.write = buffer_sink_write;
+	sink.rewind = buffer_sink_rewind;
+	sink.validate = NULL;
+	sink.data = xfer;
+	xfer->response = response;
+	xfer->start = response->n;
+	reset(xfer);
+	if (tap)
+		xfer->tap = *tap;
+	if (cls != HTTP_IMAGE && !payload && !(flags & HTTP_NOCACHE) && (xfer->cache = cache_open(url))) {
+		if (cls == HTTP_ATHOME && cache_fresh(xfer->cache, ATHOME_TTL) && !cache_load(xfer->cache, response)) {
+			release(xfer);
+			xfer->done = 1;
+			xfer->result = OK;
+			return OK;
+		}
+		if (conditional(xfer, headers)) {
+			release(xfer);
 			return ERROR;
-		--retries;
-		msleep(RETRY_DELAY);
+		}
+		if (xfer->headers)
+			headers = xfer->headers;
+	}
+	if (start(xfer, cls, url, headers, payload, &sink)) {
+		release(xfer);
+		return ERROR;
 	}
-	msleep(1000 / REQS_PER_SECOND);
 	return OK;
 }
 
+static size_t discard_write(void *data, const char *ptr, size_t size)
+{
+	return size;
+}
+
+static void discard_rewind(void *data)
+{
+}
+
+void http_prewarm(const char *url)
+{
+	http_sink_t sink;
+	if (!warm.done || (flags & (HTTP_RECORD | HTTP_REPLAY)))
+		return;
+	sink.write = discard_write;
+	sink.rewind = discard_rewind;
+	sink.validate = NULL;
+	sink.data = NULL;
+	reset(&warm);
+	if (start(&warm, HTTP_IMAGE, url, NULL, NULL, &sink)) {
+		release(&warm);
+		return;
+	}
+	warm.retries = 0;
+	curl_easy_setopt(warm.handle, CURLOPT_NOBODY, 1L);
+}
+
+static int detach(http_xfer_t **list, http_xfer_t *xfer)
+{
+	for (; *list && *list != xfer; list = &(*list)->next);
+	if (!*list)
+		return 0;
+	*list = xfer->next;
+	return 1;
+}
+
+void http_watch(int fd)
+{
+	watched = fd;
+}
+
+void http_cancel(http_xfer_t *xfer)
+{
+	if (xfer->done)
+		return;
+	if (!detach(&pending, xfer) && xfer->handle) {
+		detach(&paused, xfer);
+		curl_multi_remove_handle(multi, xfer->handle);
+		--active;
+	}
+	finish(xfer, ERROR);
+}
+
+static int ranged(http_xfer_t *xfer)
+{
+	char range[32];
+	const http_headers_t *headers = xfer->request;
+	int resume = xfer->offset && *xfer->validator;
+	buffer_t line = buffer_make(0);
+	http_headers_free(&xfer->headers);
+	if (resume) {
+		for (; headers; headers = headers->next)
+			if (http_headers_push(&xfer->headers, headers->data))
+				goto error;
+		if (buffer_append(&line, "If-Range: ") ||
+		    buffer_append(&line, xfer->validator) ||
+		    http_headers_push(&xfer->headers, line.data))
+			goto error;
+		sprintf(range, "%lu-", (unsigned long)xfer->offset);
+		headers = xfer->headers;
+	}
+	buffer_free(&line);
+	if (xfer->handle && (curl_easy_setopt(xfer->handle, CURLOPT_RANGE, resume ? range : NULL) != CURLE_OK ||
+	                     curl_easy_setopt(xfer->handle, CURLOPT_HTTPHEADER, headers) != CURLE_OK))
+		return ERROR;
+	return OK;
+error:
+	buffer_free(&line);
+	return ERROR;
+}
+
+static long acquire(unsigned cls, long now)
+{
+	long wait = rate_wait(&rates[cls], now);
+	if (cls == HTTP_ATHOME) {
+		long api = rate_wait(&rates[HTTP_API], now);
+		if (wait < api)
+			wait = api;
+		if (!wait)
+			rate_take(&rates[HTTP_API]);
+	}
+	if (!wait)
+		rate_take(&rates[cls]);
+	return wait;
+}
+
+static void conclude(http_xfer_t *xfer, int code, long status);
+
+static size_t replay_head(void *data, const char *ptr, size_t size)
+{
+	http_xfer_t *xfer = data;
+	return buffer_write(&xfer->head, ptr, size);
+}
+
+static size_t replay_body(void *data, const char *ptr, size_t size)
+{
+	return callback((char *)ptr, 1, size, data);
+}
+
+static void replay(http_xfer_t *xfer)
+{
+	const track_t *track = xfer->track;
+	metrics_sample_t sample;
+	char *line, *end;
+	if (!track) {
+		printf("No recorded response: %s\n", xfer->url);
+		finish(xfer, ERROR);
+		return;
+	}
+	if (cassette_play(track, 0, track->head, replay_head, xfer)) {
+		finish(xfer, ERROR);
+		return;
+	}
+	line = xfer->head.data;
+	end = line + xfer->head.n;
+	while (line < end) {
+		char *eol = memchr(line, '\n', (size_t)(end - line));
+		size_t n = eol ? (size_t)(eol - line) + 1 : (size_t)(end - line);
+		header_callback(line, 1, n, xfer);
+		line += n;
+	}
+	if (cassette_play(track, (long)track->head, track->body, replay_body, xfer) && !xfer->restart) {
+		finish(xfer, ERROR);
+		return;
+	}
+	memset(&sample, 0, sizeof(sample));
+	sample.total = (double)track->time * latency / 1000.0;
+	sample.bytes = (double)track->body;
+	sample.failed = track->code != CURLE_OK || track->status >= 400;
+	metrics_request(xfer->cls, &sample);
+	conclude(xfer, track->code, track->status);
+}
+
+static int activate(long now, long *wait)
+{
+	int finished = 0;
+	http_xfer_t **it = &pending, *xfer;
+	while ((xfer = *it)) {
+		if (xfer->due <= now && !xfer->track && (flags & HTTP_REPLAY)) {
+			if ((xfer->track = cassette_find(xfer->url)))
+				xfer->due = now + (long)((double)xfer->track->time * latency);
+		} else if (xfer->due <= now && !xfer->track) {
+			long delay = acquire(xfer->cls, now);
+			if (delay && !xfer->blocked) {
+				xfer->blocked = now;
+			} else if (!delay && xfer->blocked) {
+				metrics_sleep(xfer->cls, now - xfer->blocked);
+				xfer->blocked = 0;
+			}
+			xfer->due = now + delay;
+		}
+		if (xfer->due > now) {
+			if (xfer->due - now < *wait)
+				*wait = xfer->due - now;
+			it = &xfer->next;
+			continue;
+		}
+		*it = xfer->next;
+		xfer->remaining = -1;
+		xfer->delay = 0;
+		if (xfer->cache) {
+			xfer->cache->etag[0] = '\0';
+			xfer->cache->modified[0] = '\0';
+		}
+		buffer_rewind(&xfer->head, 0);
+		buffer_rewind(&xfer->body, 0);
+		xfer->status = 0;
+		xfer->range = -1;
+		xfer->tag[0] = '\0';
+		xfer->started = 0;
+		xfer->restart = 0;
+		if (xfer->resumable && ranged(xfer)) {
+			finish(xfer, ERROR);
+			finished = 1;
+			continue;
+		}
+		if (flags & HTTP_REPLAY) {
+			replay(xfer);
+			finished = 1;
+			continue;
+		}
+		if (curl_multi_add_handle(multi, xfer->handle) != CURLM_OK) {
+			finish(xfer, ERROR);
+			finished = 1;
+			continue;
+		}
+		++active;
+	}
+	return finished;
+}
+
+static int revalidate(http_xfer_t *xfer, long status)
+{
+	cache_t *cache = xfer->cache;
+	buffer_t *body = xfer->response;
+	if (status == 304) {
+		xfer->sink.rewind(xfer->sink.data);
+		return cache_load(cache, body);
+	}
+	if (*cache->etag || *cache->modified || xfer->cls == HTTP_ATHOME)
+		cache_store(cache, body->data ? body->data + xfer->start : "", body->n - xfer->start);
+	return OK;
+}
+
+static int satisfied(const http_xfer_t *xfer, long status)
+{
+	return status == 416 && xfer->resumable && xfer->offset && *xfer->validator &&
+	       xfer->range == (long)xfer->offset && (!*xfer->tag || !strcmp(xfer->tag, xfer->validator));
+}
+
+static void conclude(http_xfer_t *xfer, int code, long status)
+{
+	rate_limit(&rates[xfer->cls], mclock(), xfer->remaining, xfer->delay);
+	if (code == CURLE_OK && satisfied(xfer, status)) {
+		finish(xfer, OK);
+	} else if ((xfer->restart || (status == 416 && xfer->resumable)) && *xfer->validator) {
+		xfer->sink.rewind(xfer->sink.data);
+		xfer->offset = 0;
+		xfer->validator[0] = '\0';
+		schedule(xfer, 0);
+	} else if (code == CURLE_OK && status < 400) {
+		finish(xfer, xfer->cache ? revalidate(xfer, status) : OK);
+	} else if (xfer->retries && retry_check(code, status) == RETRY_AGAIN) {
+		unsigned attempt = budgets[xfer->cls] - xfer->retries--;
+		long after = status == 429 || status == 503 ? xfer->delay : 0;
+		long delay = retry_delay(attempt, after);
+		if (!xfer->resumable || !*xfer->validator) {
+			xfer->sink.rewind(xfer->sink.data);
+			xfer->offset = 0;
+		}
+		metrics_retry(xfer->cls, delay);
+		schedule(xfer, delay);
+	} else {
+		finish(xfer, ERROR);
+	}
+}
+
+static void collect(CURL *curl, const http_xfer_t *xfer, CURLcode code, long status)
+{
+	metrics_sample_t sample;
+	curl_off_t dns = 0, connect = 0, tls = 0, ttfb = 0, total = 0, bytes = 0;
+	if (xfer == &warm)
+		return;
+	curl_easy_getinfo(curl, CURLINFO_NAMELOOKUP_TIME_T, &dns);
+	curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME_T, &connect);
+	curl_easy_getinfo(curl, CURLINFO_APPCONNECT_TIME_T, &tls);
+	curl_easy_getinfo(curl, CURLINFO_STARTTRANSFER_TIME_T, &ttfb);
+	curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME_T, &total);
+	curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD_T, &bytes);
+	sample.dns = (double)dns / 1e6;
+	sample.connect = (double)connect / 1e6;
+	sample.tls = (double)tls / 1e6;
+	sample.ttfb = (double)ttfb / 1e6;
+	sample.total = (double)total / 1e6;
+	sample.bytes = (double)bytes;
+	sample.failed = code != CURLE_OK || status >= 400;
+	metrics_request(xfer->cls, &sample);
+}
+
+static void complete(CURL *curl, CURLcode code)
+{
+	char *priv = NULL;
+	long status = 0;
+	double time = 0.0;
+	http_xfer_t *xfer;
+	curl_easy_getinfo(curl, CURLINFO_PRIVATE, &priv);
+	curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+	xfer = (http_xfer_t *)(void *)priv;
+	curl_multi_remove_handle(multi, curl);
+	--active;
+	detach(&paused, xfer);
+	if ((flags & HTTP_MULTIPLEX) && code == CURLE_OK)
+		check_version(curl);
+	collect(curl, xfer, code, status);
+	if (flags & HTTP_RECORD) {
+		curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME, &time);
+		if (cassette_record(xfer->url, status, (int)code, (long)(time * 1000.0), &xfer->head, &xfer->body)) {
+			puts("Failed to record response");
+			finish(xfer, ERROR);
+			return;
+		}
+	}
+	conclude(xfer, (int)code, status);
+}
+
+static void throttle(long now, long *wait)
+{
+	long delay;
+	http_xfer_t *xfer, *next;
+	double current = bandwidth_limit(time(NULL));
+	if (current != limit) {
+		limit = current;
+		bandwidth = rate_make(limit, limit);
+	}
+	if (!paused)
+		return;
+	if ((delay = rate_wait(&bandwidth, now))) {
+		if (delay < *wait)
+			*wait = delay;
+		return;
+	}
+	xfer = paused;
+	paused = NULL;
+	for (; xfer; xfer = next) {
+		next = xfer->next;
+		curl_easy_pause(xfer->handle, CURLPAUSE_CONT);
+	}
+}
+
+int http_poll(void)
+{
+	char drain[64];
+	int running, msgs, finished;
+	long now, wait = POLL_TIMEOUT;
+	struct curl_waitfd extra;
+	CURLMsg *msg;
+	metrics_poll();
+	if (!active && !pending && watched < 0)
+		return ERROR;
+	now = mclock();
+	if (shaping)
+		throttle(now, &wait);
+	finished = activate(now, &wait);
+	if (curl_multi_perform(multi, &running) != CURLM_OK)
+		return ERROR;
+	while ((msg = curl_multi_info_read(multi, &msgs))) {
+		if (msg->msg != CURLMSG_DONE)
+			continue;
+		complete(msg->easy_handle, msg->data.result);
+		finished = 1;
+	}
+	if (finished)
+		return OK;
+	extra.fd = watched;
+	extra.events = CURL_WAIT_POLLIN;
+	extra.revents = 0;
+	if (curl_multi_poll(multi, &extra, watched >= 0 ? 1u : 0u, (int)wait, NULL) != CURLM_OK)
+		return ERROR;
+	if (extra.revents)
+		while (read(watched, drain, sizeof(drain)) > 0);
+	return OK;
+}
+
+int http_get(unsigned cls, const char *url, const http_headers_t *headers, const char *payload, buffer_t *response, const http_sink_t *tap)
+{
+	http_xfer_t xfer;
+	if (http_start(&xfer, cls, url, headers, payload, response, tap))
+		return ERROR;
+	while (!xfer.done) {
+		if (http_poll()) {
+			http_cancel(&xfer);
+			return ERROR;
+		}
+	}
+	return xfer.result;
+}
+
 int http_headers_push(http_headers_t **headers, const char *string)
 {
 	struct curl_slist *tmp = curl_slist_append(*headers, string);
@@ -7,8 +7,62 @@ typedef struct curl_slist http_headers_t;
 int http_headers_push(http_headers_t **headers, const char *string);
 void http_headers_free(http_headers_t **headers);
 
-int http_init(void);
+#define HTTP_MULTIPLEX (1 << 0)
+#define HTTP_NOCACHE (1 << 1)
+#define HTTP_RECORD (1 << 2)
+#define HTTP_REPLAY (1 << 3)
+
+#define HTTP_API 0
+#define HTTP_ATHOME 1
+#define HTTP_IMAGE 2
+#define HTTP_CLASSES 3
+
+typedef struct http_sink {
+	size_t (*write)(void *data, const char *ptr, size_t size);
+	void (*rewind)(void *data);
+	void (*validate)(void *data, const char *validator);
+	void *data;
+} http_sink_t;
+
+typedef struct http_xfer {
+	void *handle;
+	http_sink_t sink, tap;
+	buffer_t *response;
+	size_t start;
+	http_headers_t *headers;
+	const http_headers_t *request;
+	struct cache *cache;
+	char *url;
+	struct track *track;
+	buffer_t head, body;
+	unsigned cls;
+	unsigned retries;
+	size_t offset;
+	long due, blocked, remaining, delay, status, range;
+	int resumable, started, restart;
+	int done, result;
+	char validator[128], tag[128];
+	struct http_xfer *next;
+} http_xfer_t;
+
+typedef struct http_args {
+	const char *retries;
+	const char *cache;
+	const char *cassette;
+	const char *latency;
+	const char *bandwidth;
+	unsigned flags;
+} http_args_t;
+
+int http_init(const http_args_t *args);
 void http_free(void);
-int http_get(const char *url, const http_headers_t *headers, const char *payload, buffer_t *response);
+int http_start(http_xfer_t *xfer, unsigned cls, const char *url, const http_headers_t *headers, const char *payload, buffer_t *response, const http_sink_t *tap);
+int http_stream(http_xfer_t *xfer, unsigned cls, const char *url, const http_headers_t *headers, const char *payload, const http_sink_t *sink);
+int http_resume(http_xfer_t *xfer, unsigned cls, const char *url, const http_headers_t *headers, const http_sink_t *sink, size_t offset, const char *validator);
+void http_prewarm(const char *url);
+void http_watch(int fd);
+void http_cancel(http_xfer_t *xfer);
+int http_poll(void);
+int http_get(unsigned cls, const char *url, const http_headers_t *headers, const char *payload, buffer_t *response, const http_sink_t *tap);
 
 #endif
@@ -2,19 +2,30 @@
 #include <string.h>
 #include <stdio.h>
 #include <ctype.h>
-#define JSMN_PARENT_LINKS
-#define JSMN_STRICT
-#ifdef __GNUC__
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wsign-conversion"
-#endif
-#include "jsmn.h"
-#ifdef __GNUC__
-#pragma GCC diagnostic pop
-#endif
+#include <limits.h>
+#include <pthread.h>
 #include "util.h"
 #include "json.h"
 
+#define NONE ((size_t)-1)
+#define EXPECT_VALUE 0
+#define EXPECT_KEY 1
+#define EXPECT_COLON 2
+#define EXPECT_NEXT 3
+#define BLOCK (sizeof(unsigned long) * CHAR_BIT)
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && !defined(JSON_NO_SIMD)
+#define JSON_SIMD
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+typedef struct masks {
+	unsigned long quote, backslash, structural, space;
+} masks_t;
+
+typedef void (*classify_t)(const char *block, masks_t *masks);
+
 static int parse_code(const char *ptr, unsigned *code)
 {
 	const char *end = ptr + 4;
@@ -47,73 +58,425 @@ static size_t utf8_encode(unsigned code, char *buf)
 		*out++ = (unsigned char)(((code >> 6) & 0x3f) | 0x80);
 		*out++ = (unsigned char)(((code >> 0) & 0x3f) | 0x80);
 		return 3;
+	} else if (code <= 0x10ffff) {
+		*out++ = (unsigned char)(((code >> 18) & 0x07) | 0xf0);
+		*out++ = (unsigned char)(((code >> 12) & 0x3f) | 0x80);
+		*out++ = (unsigned char)(((code >> 6) & 0x3f) | 0x80);
+		*out++ = (unsigned char)(((code >> 0) & 0x3f) | 0x80);
+		return 4;
 	}
 	return 0;
 }
 
+static char *unescape(char *dest, const char *ptr, size_t size)
+{
+	const char *end = ptr + size, *slash;
+	unsigned code, low;
+	while ((slash = memchr(ptr, '\\', (size_t)(end - ptr))) && slash + 1 < end) {
+		memcpy(dest, ptr, (size_t)(slash - ptr));
+		dest += slash - ptr;
+		ptr = slash + 2;
+		switch (slash[1]) {
+		case 'b': *dest++ = '\b'; break;
+		case 'f': *dest++ = '\f'; break;
+		case 'n': *dest++ = '\n'; break;
+		case 'r': *dest++ = '\r'; break;
+		case 't': *dest++ = '\t'; break;
+		case 'u':
+			if (end - ptr < 4 || parse_code(ptr, &code))
+				return NULL;
+			ptr += 4;
+			if (code >= 0xd800 && code < 0xdc00 && end - ptr >= 6 && ptr[0] == '\\' && ptr[1] == 'u' &&
+			    !parse_code(ptr + 2, &low) && low >= 0xdc00 && low < 0xe000) {
+				code = 0x10000 + ((code - 0xd800) << 10) + (low - 0xdc00);
+				ptr += 6;
+			}
+			dest += utf8_encode(code, dest);
+			break;
+		default:
+			*dest++ = slash[1];
+		}
+	}
+	memcpy(dest, ptr, (size_t)(end - ptr));
+	dest += end - ptr;
+	*dest = '\0';
+	return dest;
+}
+
 char *json_unescape(const char *ptr, size_t size)
 {
-	char ch;
-	size_t n;
-	char seq[3];
-	unsigned code;
-	const char *end;
-	buffer_t buf;
-	if (!size)
-		return strdup("");
-	end = ptr + size;
-	buf = buffer_make(size);
-	while (ptr < end) {
-		ch = *ptr++;
-		if (ch == '\\' && ptr < end) {
-			ch = *ptr++;
-			switch (ch) {
-			case 'b': ch = '\b'; goto putchar;
-			case 'f': ch = '\f'; goto putchar;
-			case 'n': ch = '\n'; goto putchar;
-			case 'r': ch = '\r'; goto putchar;
-			case 't': ch = '\t'; goto putchar;
-			case 'u':
-			          if (end - ptr < 4 || parse_code(ptr, &code))
-				          goto cleanup;
-			          n = utf8_encode(code, seq);
-			          if (buffer_strcpy(&buf, seq, n))
-				          goto cleanup;
-			          ptr += 4;
-			          break;
+	char *str = malloc(size + 1);
+	if (str && !unescape(str, ptr, size)) {
+		free(str);
+		return NULL;
+	}
+	return str;
+}
+
+static int push(json_tokens_t *tokens, unsigned type, size_t start, size_t end)
+{
+	json_t token;
+	token.type = type & 0xf;
+	token.size = 0;
+	token.skip = 1;
+	token.start = (unsigned)start;
+	token.end = (unsigned)end;
+	return json_tokens_push(tokens, &token);
+}
+
+static void attach(json_tokens_t *tokens, size_t parent, size_t key)
+{
+	if (key != NONE)
+		++tokens->data[key].size;
+	else if (parent != NONE)
+		++tokens->data[parent].size;
+}
+
+static int check_string(const char *data, size_t pos, size_t end)
+{
+	const char *ptr;
+	size_t i;
+	while ((ptr = memchr(data + pos, '\\', end - pos))) {
+		pos = (size_t)(ptr - data) + 1;
+		switch (data[pos]) {
+		case '"': case '/': case '\\': case 'b':
+		case 'f': case 'n': case 'r': case 't':
+			break;
+		case 'u':
+			for (i = 0; i < 4; ++i)
+				if (++pos == end || !isxdigit((unsigned char)data[pos]))
+					return ERROR;
+			break;
+		default:
+			return ERROR;
+		}
+		++pos;
+	}
+	return OK;
+}
+
+static size_t skip_primitive(const char *data, size_t pos, size_t size)
+{
+	for (; pos < size; ++pos) {
+		switch (data[pos]) {
+		case ' ': case '\t': case '\r': case '\n':
+		case ',': case ']': case '}':
+			return pos;
+		case '"':
+			return NONE;
+		}
+		if (data[pos] < 32 || data[pos] >= 127)
+			return NONE;
+	}
+	return pos;
+}
+
+static const unsigned char classes[256] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 8, 8, 0, 0, 8, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	8, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 4, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 4, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 4, 2, 4, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 4, 0, 4, 0, 0
+};
+
+static void classify(const char *block, masks_t *masks)
+{
+	unsigned long c, quote = 0, backslash = 0, structural = 0, space = 0;
+	size_t i;
+	for (i = 0; i < BLOCK; ++i) {
+		c = classes[(unsigned char)block[i]];
+		quote |= (c & 1) << i;
+		backslash |= (c >> 1 & 1) << i;
+		structural |= (c >> 2 & 1) << i;
+		space |= (c >> 3) << i;
+	}
+	masks->quote = quote;
+	masks->backslash = backslash;
+	masks->structural = structural;
+	masks->space = space;
+}
+
+#ifdef JSON_SIMD
+#define EQ128(V, C) _mm_cmpeq_epi8(V, _mm_set1_epi8(C))
+#define EQ256(V, C) _mm256_cmpeq_epi8(V, _mm256_set1_epi8(C))
+#define MASK128(V) ((unsigned long)(unsigned)_mm_movemask_epi8(V) << i)
+#define MASK256(V) ((unsigned long)(unsigned)_mm256_movemask_epi8(V) << i)
+
+__attribute__((target("sse2")))
+static void classify_sse2(const char *block, masks_t *masks)
+{
+	__m128i v, low;
+	size_t i;
+	memset(masks, 0, sizeof(*masks));
+	for (i = 0; i < BLOCK; i += 16) {
+		v = _mm_loadu_si128((const __m128i *)(block + i));
+		low = _mm_or_si128(v, _mm_set1_epi8(0x20));
+		masks->quote |= MASK128(EQ128(v, '"'));
+		masks->backslash |= MASK128(EQ128(v, '\\'));
+		masks->structural |= MASK128(_mm_or_si128(_mm_or_si128(EQ128(low, '{'), EQ128(low, '}')),
+		                                          _mm_or_si128(EQ128(v, ':'), EQ128(v, ','))));
+		masks->space |= MASK128(_mm_or_si128(_mm_or_si128(EQ128(v, ' '), EQ128(v, '\t')),
+		                                     _mm_or_si128(EQ128(v, '\r'), EQ128(v, '\n'))));
+	}
+}
+
+__attribute__((target("avx2")))
+static void classify_avx2(const char *block, masks_t *masks)
+{
+	__m256i v, low;
+	size_t i;
+	memset(masks, 0, sizeof(*masks));
+	for (i = 0; i < BLOCK; i += 32) {
+		v = _mm256_loadu_si256((const __m256i *)(block + i));
+		low = _mm256_or_si256(v, _mm256_set1_epi8(0x20));
+		masks->quote |= MASK256(EQ256(v, '"'));
+		masks->backslash |= MASK256(EQ256(v, '\\'));
+		masks->structural |= MASK256(_mm256_or_si256(_mm256_or_si256(EQ256(low, '{'), EQ256(low, '}')),
+		                                             _mm256_or_si256(EQ256(v, ':'), EQ256(v, ','))));
+		masks->space |= MASK256(_mm256_or_si256(_mm256_or_si256(EQ256(v, ' '), EQ256(v, '\t')),
+		                                        _mm256_or_si256(EQ256(v, '\r'), EQ256(v, '\n'))));
+	}
+}
+
+static unsigned xgetbv(void)
+{
+	unsigned a, d;
+	__asm__("xgetbv" : "=a"(a), "=d"(d) : "c"(0));
+	return a;
+}
+#endif
+
+static classify_t chosen, detected = classify;
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+static void detect(void)
+{
+#ifdef JSON_SIMD
+	unsigned a, b, c, d;
+	if (__get_cpuid(1, &a, &b, &c, &d) && (c & bit_OSXSAVE) && (xgetbv() & 6) == 6 &&
+	    __get_cpuid_count(7, 0, &a, &b, &c, &d) && (b & bit_AVX2))
+		detected = classify_avx2;
+	else if (__get_cpuid(1, &a, &b, &c, &d) && (d & bit_SSE2))
+		detected = classify_sse2;
+#endif
+}
+
+static classify_t pick(void)
+{
+	pthread_once(&once, detect);
+	return chosen ? chosen : detected;
+}
+
+static unsigned long find_escaped(unsigned long backslash, unsigned long *carry)
+{
+	unsigned long even = ~0UL / 3, escape, follows, sum;
+	if (!backslash) {
+		follows = *carry;
+		*carry = 0;
+		return follows;
+	}
+	escape = backslash & ~*carry;
+	follows = escape << 1 | *carry;
+	sum = (escape & ~even & ~follows) + escape;
+	*carry = sum < escape;
+	return (even ^ sum << 1) & follows;
+}
+
+static unsigned long prefix_xor(unsigned long bits)
+{
+	size_t shift;
+	for (shift = 1; shift < BLOCK; shift <<= 1)
+		bits ^= bits << shift;
+	return bits;
+}
+
+#ifdef __GNUC__
+#define CTZ(X) ((size_t)__builtin_ctzl(X))
+#else
+static size_t ctz(unsigned long bits)
+{
+	size_t n = 0;
+	for (; !(bits & 1); bits >>= 1)
+		++n;
+	return n;
+}
+#define CTZ(X) ctz(X)
+#endif
+
+static int run(json_parser_t *parser, const char *data, size_t size, int final)
+{
+	char ch, tail[BLOCK];
+	const char *block;
+	json_t *token;
+	masks_t masks;
+	json_tokens_t *tokens = parser->tokens;
+	classify_t scan = pick();
+	unsigned long events, inside, other, escape;
+	size_t base, bit, pos, end, next = parser->next, open = parser->open, slash = parser->slash;
+	size_t parent = parser->parent, key = parser->key;
+	int expect = parser->expect, empty = parser->empty;
+	for (base = parser->base; final ? base < size : size - base >= BLOCK; base += BLOCK) {
+		block = data + base;
+		if (size - base < BLOCK) {
+			memset(tail, ' ', BLOCK);
+			memcpy(tail, block, size - base);
+			block = tail;
+		}
+		scan(block, &masks);
+		escape = parser->escape;
+		masks.quote &= ~find_escaped(masks.backslash, &escape);
+		inside = prefix_xor(masks.quote) ^ parser->string;
+		other = ~(masks.structural | masks.space | masks.quote | inside);
+		events = masks.quote | (masks.structural & ~inside) | (other & ~(other << 1 | parser->primitive));
+		if (masks.backslash)
+			slash = base;
+		for (; events; events &= events - 1) {
+			if ((pos = base + (bit = CTZ(events))) < next)
+				continue;
+			if (open != NONE) {
+				if (slash != NONE && slash + BLOCK > open && check_string(data, open, pos))
+					goto error;
+				attach(tokens, parent, key);
+				if (push(tokens, JSON_STRING, open, pos))
+					goto error;
+				open = NONE;
+				if (expect == EXPECT_KEY) {
+					expect = EXPECT_COLON;
+					empty = 0;
+					if (bit + 1 < BLOCK && block[bit + 1] == ':') {
+						events &= ~(2UL << bit);
+						key = tokens->n - 1;
+						expect = EXPECT_VALUE;
+					}
+					continue;
+				}
+			} else switch (ch = data[pos]) {
+			case '{': case '[':
+				if (expect != EXPECT_VALUE)
+					goto error;
+				attach(tokens, parent, key);
+				if (push(tokens, ch == '{' ? JSON_OBJECT : JSON_ARRAY, pos, parent + 1))
+					goto error;
+				parent = tokens->n - 1;
+				key = NONE;
+				expect = ch == '{' ? EXPECT_KEY : EXPECT_VALUE;
+				empty = 1;
+				continue;
+			case '}': case ']':
+				if (parent == NONE || (expect != EXPECT_NEXT && !empty))
+					goto error;
+				token = &tokens->data[parent];
+				if (token->type != (ch == '}' ? JSON_OBJECT : JSON_ARRAY))
+					goto error;
+				end = (size_t)(token - tokens->data);
+				token->skip = (unsigned)(tokens->n - end);
+				parent = (size_t)token->end - 1;
+				token->end = (unsigned)pos + 1;
+				if (parent != NONE && tokens->data[parent].type == JSON_OBJECT)
+					key = end - 1;
+				break;
+			case '"':
+				if (expect != EXPECT_KEY && expect != EXPECT_VALUE)
+					goto error;
+				open = pos + 1;
+				continue;
+			case ':':
+				if (expect != EXPECT_COLON)
+					goto error;
+				key = tokens->n - 1;
+				expect = EXPECT_VALUE;
+				continue;
+			case ',':
+				if (expect != EXPECT_NEXT || parent == NONE)
+					goto error;
+				expect = tokens->data[parent].type == JSON_OBJECT ? EXPECT_KEY : EXPECT_VALUE;
+				continue;
+			case '-': case '0': case '1': case '2': case '3': case '4':
+			case '5': case '6': case '7': case '8': case '9':
+			case 't': case 'f': case 'n':
+				if (expect != EXPECT_VALUE || (end = skip_primitive(data, pos, size)) == NONE)
+					goto error;
+				if (end == size && !final) {
+					next = pos;
+					goto suspend;
+				}
+				attach(tokens, parent, key);
+				if (push(tokens, JSON_PRIMITIVE, pos, next = end))
+					goto error;
+				break;
 			default:
-			          goto putchar;
+				goto error;
+			}
+			if (key != NONE)
+				tokens->data[key].skip = (unsigned)(tokens->n - key);
+			key = NONE;
+			expect = EXPECT_NEXT;
+			empty = 0;
+			if (bit + 1 < BLOCK && block[bit + 1] == ',' && parent != NONE) {
+				events &= ~(2UL << bit);
+				expect = tokens->data[parent].type == JSON_OBJECT ? EXPECT_KEY : EXPECT_VALUE;
 			}
-		} else putchar: {
-			if (buffer_strcpy(&buf, &ch, 1))
-				goto cleanup;
 		}
+		parser->escape = escape;
+		parser->string = 0UL - (inside >> (BLOCK - 1));
+		parser->primitive = other >> (BLOCK - 1);
 	}
-	buffer_shrink(&buf);
-	return buf.data;
-cleanup:
-	buffer_free(&buf);
-	return NULL;
+suspend:
+	parser->base = base;
+	parser->next = next;
+	parser->open = open;
+	parser->slash = slash;
+	parser->parent = parent;
+	parser->key = key;
+	parser->expect = expect;
+	parser->empty = empty;
+	return OK;
+error:
+	parser->result = ERROR;
+	return ERROR;
 }
 
-json_t *json_parse(const char *data, size_t size)
+void json_start(json_parser_t *parser, json_tokens_t *tokens)
 {
-	int n;
-	jsmntok_t *tokens;
-	jsmn_parser parser;
-	if (!size)
-		return NULL;
-	jsmn_init(&parser);
-	if (((n = jsmn_parse(&parser, data, size, NULL, 0)) < 1) ||
-	    (!(tokens = malloc((unsigned)n * sizeof(*tokens)))))
+	tokens->n = 0;
+	parser->tokens = tokens;
+	parser->base = 0;
+	parser->next = 0;
+	parser->open = NONE;
+	parser->slash = NONE;
+	parser->parent = NONE;
+	parser->key = NONE;
+	parser->escape = 0;
+	parser->string = 0;
+	parser->primitive = 0;
+	parser->expect = EXPECT_VALUE;
+	parser->empty = 0;
+	parser->result = OK;
+}
+
+int json_feed(json_parser_t *parser, const char *data, size_t size)
+{
+	if (parser->result || size >= UINT_MAX)
+		return ERROR;
+	return run(parser, data, size, 0);
+}
+
+const json_t *json_finish(json_parser_t *parser, const char *data, size_t size)
+{
+	if (parser->result || !size || size >= UINT_MAX || run(parser, data, size, 1) ||
+	    parser->open != NONE || parser->parent != NONE || parser->expect != EXPECT_NEXT)
 		return NULL;
-	jsmn_init(&parser);
-	if (jsmn_parse(&parser, data, size, tokens, (unsigned)n) < 1)
-		goto cleanup;
-	return tokens;
-cleanup:
-	free(tokens);
-	return NULL;
+	return parser->tokens->data;
+}
+
+const json_t *json_parse(json_tokens_t *tokens, const char *data, size_t size)
+{
+	json_parser_t parser;
+	json_start(&parser, tokens);
+	return json_finish(&parser, data, size);
 }
 
 int json_eql(const char *data, const json_t *token, const char *str, size_t strlen)
@@ -139,13 +502,13 @@ const json_t *json_find(const char *data, const json_t *token, const char *name)
 			long i = atol(name);
 			if (i >= token->size)
 				return NULL;
-			for (++token; i--; i += token++->size);
+			for (++token; i--; token += token->skip);
 			goto found;
 		} else if (token->type == JSON_OBJECT) {
-			long i = token++->size, j;
+			long i = token++->size;
 			while (i--) {
 				if (!json_eql(data, token, name, (size_t)(next - name))) {
-					for (j = token->size; j--; j += token++->size);
+					token += token->skip;
 				} else {
 					++token;
 					goto found;
@@ -161,6 +524,42 @@ found:
 	return NULL;
 }
 
+static void collect(const char *data, const json_t *token, const char *prefix, size_t offset,
+                    const char *const *paths, const json_t **fields, size_t n)
+{
+	const json_t *key;
+	const char *path, *nested;
+	size_t i, len;
+	json_iter_t it = json_iter(token);
+	while (json_next(&key, &it)) {
+		nested = NULL;
+		for (i = 0; i < n; ++i) {
+			if (fields[i] || strncmp(paths[i], prefix, offset))
+				continue;
+			path = paths[i] + offset;
+			len = strcspn(path, ".");
+			if (!json_eql(data, key, path, len))
+				continue;
+			if (!path[len])
+				fields[i] = key + 1;
+			else if (key[1].type == JSON_OBJECT && !nested)
+				nested = paths[i];
+		}
+		if (nested)
+			collect(data, key + 1, nested, (size_t)(strchr(nested + offset, '.') - nested) + 1,
+			        paths, fields, n);
+	}
+}
+
+void json_fields(const char *data, const json_t *token, const char *const *paths, const json_t **fields, size_t n)
+{
+	size_t i;
+	for (i = 0; i < n; ++i)
+		fields[i] = NULL;
+	if (token->type == JSON_OBJECT)
+		collect(data, token, "", 0, paths, fields, n);
+}
+
 const json_t *json_find_object(const char *data, const json_t *token, const char *name)
 {
 	token = json_find(data, token, name);
@@ -223,6 +622,29 @@ char *json_strdup(const char *data, const json_t *token)
 	return NULL;
 }
 
+char *json_arena_strdup(arena_t *arena, const char *data, const json_t *token)
+{
+	char *str;
+	if (token->type != JSON_STRING || !(str = arena_alloc(arena, json_size(token) + 1)))
+		return NULL;
+	return unescape(str, data + token->start, json_size(token)) ? str : NULL;
+}
+
+const char *json_intern(arena_t *arena, const char *data, const json_t *token)
+{
+	char *str;
+	const char *interned;
+	if (token->type != JSON_STRING)
+		return NULL;
+	if (!memchr(data + token->start, '\\', json_size(token)))
+		return arena_intern(arena, data + token->start, json_size(token));
+	if (!(str = json_unescape(data + token->start, json_size(token))))
+		return NULL;
+	interned = arena_intern(arena, str, strlen(str));
+	free(str);
+	return interned;
+}
+
 double json_double(const char *data, const json_t *token)
 {
 	if (token->type & (JSON_PRIMITIVE | JSON_STRING))
@@ -1,17 +1,31 @@
 #ifndef JSON_H
 #define JSON_H
-#define JSMN_PARENT_LINKS
-#define JSMN_STRICT
-#define JSMN_HEADER
-#include "jsmn.h"
 
-#define JSON_UNDEFINED JSMN_UNDEFINED
-#define JSON_OBJECT JSMN_OBJECT
-#define JSON_ARRAY JSMN_ARRAY
-#define JSON_STRING JSMN_STRING
-#define JSON_PRIMITIVE JSMN_PRIMITIVE
+#include "util.h"
+#include "arena.h"
 
-typedef jsmntok_t json_t;
+#define JSON_UNDEFINED 0
+#define JSON_OBJECT 1
+#define JSON_ARRAY 2
+#define JSON_STRING 4
+#define JSON_PRIMITIVE 8
+
+typedef struct json {
+	unsigned start, end, skip;
+	unsigned type : 4;
+	unsigned size : 28;
+} json_t;
+
+#define VECT_NAME json_tokens
+#define VECT_ELEM json_t
+#include "vect.h"
+
+typedef struct json_parser {
+	json_tokens_t *tokens;
+	size_t base, next, open, slash, parent, key;
+	unsigned long escape, string, primitive;
+	int expect, empty, result;
+} json_parser_t;
 
 typedef struct json_iter {
 	int count;
@@ -28,13 +42,11 @@ static json_iter_t json_iter(const json_t *token)
 
 static int json_next(const json_t **elem, json_iter_t *it)
 {
-	int i = 0;
-	const json_t *token = it->token;
 	if (!it->count)
 		return 0;
-	do i += it->token++->size; while (i--);
+	*elem = it->token;
+	it->token += it->token->skip;
 	--it->count;
-	*elem = token;
 	return 1;
 }
 
@@ -55,10 +67,14 @@ static size_t json_count(const json_t *token)
 	return (size_t)token->size;
 }
 
-json_t *json_parse(const char *data, size_t size);
+void json_start(json_parser_t *parser, json_tokens_t *tokens);
+int json_feed(json_parser_t *parser, const char *data, size_t size);
+const json_t *json_finish(json_parser_t *parser, const char *data, size_t size);
+const json_t *json_parse(json_tokens_t *tokens, const char *data, size_t size);
 int json_eql(const char *data, const json_t *token, const char *str, size_t strlen);
 int json_eq(const char *data, const json_t *token, const char *str);
 const json_t *json_find(const char *data, const json_t *token, const char *name);
+void json_fields(const char *data, const json_t *token, const char *const *paths, const json_t **fields, size_t n);
 const json_t *json_find_object(const char *data, const json_t *token, const char *name);
 const json_t *json_find_array(const char *data, const json_t *token, const char *name);
 const json_t *json_find_string(const char *data, const json_t *token, const char *name);
@@ -66,6 +82,8 @@ const json_t *json_find_number(const char *data, const json_t *token, const char
 const json_t *json_find_boolean(const char *data, const json_t *token, const char *name);
 char *json_strcpy(const char *data, const json_t *token, char *dest, size_t size);
 char *json_strdup(const char *data, const json_t *token);
+char *json_arena_strdup(arena_t *arena, const char *data, const json_t *token);
+const char *json_intern(arena_t *arena, const char *data, const json_t *token);
 double json_double(const char *data, const json_t *token);
 unsigned long json_ulong(const char *data, const json_t *token);
 unsigned json_uint(const char *data, const json_t *token);
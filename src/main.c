@@ -1,20 +1,45 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include "defs.h"
 #include "http.h"
 #include "mdex.h"
+#include "metrics.h"
 
-static const char help[] =
-"Usage: mdex [-wsdnto] [-l lang] [-c list] series [group...]\n\n"
-"The first argument w/o dash must be a series link or uuid\n\n"
-"-w      Overwrite existing files\n"
-"-s      Save into a subdirectory\n"
-"-d      Report duplicate chapters\n"
-"-n      Only check and do not download\n"
-"-t      Include chapter title in filename\n"
-"-o      Override series title\n"
-"-l lang Choose language by code (default is 'en')\n"
-"-c list Choose chapters by ranges list (default is '-')\n\n"
-"The rest are scanlation groups in the order of preference";
+static const char *const help[] = {
+"Usage: mdex [-wsdntevo2KS] [-l lang] [-c list] [-j jobs] [-q mode] [-z list] [-p dir] [-f fmt] [-O file] [-r list] [-b spec] [-k dir] [-R file] [-P file] [-T x] [-M file] series [group...]",
+"",
+"The first argument w/o dash must be a series link or uuid",
+"",
+"-w      Overwrite existing files",
+"-s      Save into a subdirectory",
+"-d      Report duplicate chapters",
+"-n      Only check and do not download",
+"-t      Include chapter title in filename",
+"-e      Check every existing file and repair damaged ones",
+"-v      Verify page hashes of existing files on all cores",
+"-o      Override series title",
+"-2      Multiplex page downloads over HTTP/2",
+"-K      Do not cache API responses",
+"-S      Print a performance summary at exit",
+"-l lang Choose language by code (default is 'en')",
+"-c list Choose chapters by ranges list (default is '-')",
+"-j jobs Download this many pages at once (default is 4)",
+"-q mode Page quality: original, saver or auto (default is 'original')",
+"-z list Deflate level per image format (default is 'png=6,gif=6')",
+"-p dir  Keep downloaded pages in this content-addressed store",
+"-f fmt  Output format: zip, dir or tar (default is 'zip')",
+"-O file Write all chapters into one zip or tar stream, '-' is stdout",
+"-r list Retries for api,at-home,image requests (default is '4,4,6')",
+"-b spec Limit download speed, e.g. '2M,01:00-07:00=0' (0 is unlimited)",
+"-k dir  Cache API responses in this directory (default is '~/.cache/mdex')",
+"-R file Record every HTTP exchange into a cassette file",
+"-P file Replay HTTP exchanges from a cassette file",
+"-T x    Scale replayed latency by x (default is 1)",
+"-M file Write a JSON performance report into the file",
+"",
+"The rest are scanlation groups in the order of preference",
+NULL
+};
 
 static char *get_optval(int argc, char **argv, int *i, int j)
 {
@@ -25,10 +50,19 @@ static char *get_optval(int argc, char **argv, int *i, int j)
 	return NULL;
 }
 
-static int get_args(int argc, char **argv, mdex_args_t *out)
+static unsigned get_optnum(int argc, char **argv, int *i, int j)
+{
+	char *val = get_optval(argc, argv, i, j);
+	return val ? (unsigned)strtoul(val, NULL, 10) : 0;
+}
+
+static int get_args(int argc, char **argv, mdex_args_t *out, http_args_t *http_out, metrics_args_t *metrics_out)
 {
 	int i, j;
+	const char *const *line;
 	mdex_args_t args = {0};
+	http_args_t http_args = {0};
+	metrics_args_t metrics_args = {0};
 	for (i = 1; i < argc; ++i) {
 		if (argv[i][0] != '-') {
 			if (!args.series) {
@@ -46,42 +80,74 @@ static int get_args(int argc, char **argv, mdex_args_t *out)
 			case 'd': args.flags |= MDEX_REPORTDUP; continue;
 			case 'n': args.flags |= MDEX_CHECKONLY; continue;
 			case 't': args.flags |= MDEX_CHAPTITLE; continue;
+			case 'e': args.flags |= MDEX_REPAIR; continue;
+			case 'v': args.flags |= MDEX_VERIFY; continue;
+			case '2': http_args.flags |= HTTP_MULTIPLEX; continue;
+			case 'K': http_args.flags |= HTTP_NOCACHE; continue;
+			case 'S': metrics_args.summary = 1; continue;
 			case 'l': args.lang = get_optval(argc, argv, &i, j); goto next;
 			case 'o': args.title = get_optval(argc, argv, &i, j); goto next;
 			case 'c': args.ranges = get_optval(argc, argv, &i, j); goto next;
+			case 'j': args.jobs = get_optnum(argc, argv, &i, j); goto next;
+			case 'q': args.quality = get_optval(argc, argv, &i, j); goto next;
+			case 'z': args.compression = get_optval(argc, argv, &i, j); goto next;
+			case 'p': args.store = get_optval(argc, argv, &i, j); goto next;
+			case 'f': args.format = get_optval(argc, argv, &i, j); goto next;
+			case 'O': args.stream = get_optval(argc, argv, &i, j); goto next;
+			case 'r': http_args.retries = get_optval(argc, argv, &i, j); goto next;
+			case 'b': http_args.bandwidth = get_optval(argc, argv, &i, j); goto next;
+			case 'k': http_args.cache = get_optval(argc, argv, &i, j); goto next;
+			case 'R': http_args.flags |= HTTP_RECORD; http_args.cassette = get_optval(argc, argv, &i, j); goto next;
+			case 'P': http_args.flags |= HTTP_REPLAY; http_args.cassette = get_optval(argc, argv, &i, j); goto next;
+			case 'T': http_args.latency = get_optval(argc, argv, &i, j); goto next;
+			case 'M': metrics_args.report = get_optval(argc, argv, &i, j); goto next;
 			default: printf("Unknown option: -%c\n", argv[i][j]); goto error;
 			}
 		}
 next:;
 	}
-	if (!args.series)
+	if (!args.series || ((http_args.flags & (HTTP_RECORD | HTTP_REPLAY)) && !http_args.cassette))
 		goto error;
+	if ((http_args.flags & HTTP_RECORD) && (http_args.flags & HTTP_REPLAY)) {
+		puts("Cannot record and replay at the same time");
+		return ERROR;
+	}
 	*out = args;
+	*http_out = http_args;
+	*metrics_out = metrics_args;
 	return OK;
 error:
-	puts(help);
+	for (line = help; *line; ++line)
+		puts(*line);
 	return ERROR;
 }
 
-static int global_init(void)
+static int global_init(const http_args_t *http_args)
 {
-	if (http_init())
+	metrics_init();
+	if (http_init(http_args))
 		return ERROR;
 	return OK;
 }
 
-static void global_free(void)
+static void global_free(const metrics_args_t *metrics_args)
 {
 	http_free();
+	if (metrics_args->summary)
+		metrics_print(stderr);
+	if (metrics_args->report && metrics_report(metrics_args->report))
+		printf("Failed to write report: %s\n", metrics_args->report);
 }
 
 int main(int argc, char **argv)
 {
 	int result;
 	mdex_args_t args;
-	if (get_args(argc, argv, &args) || global_init())
+	http_args_t http_args;
+	metrics_args_t metrics_args;
+	if (get_args(argc, argv, &args, &http_args, &metrics_args) || global_init(&http_args))
 		return ERROR;
 	result = mdex_download(&args);
-	global_free();
+	global_free(&metrics_args);
 	return result;
 }
@@ -5,20 +5,40 @@
 #include <regex.h>
 #include <unistd.h>
 #include <sys/stat.h>
-#include <minizip/unzip.h>
-#include <minizip/zip.h>
 #include "util.h"
 #include "http.h"
 #include "json.h"
+#include "arena.h"
+#include "spool.h"
+#include "archive.h"
+#include "output.h"
+#include "pack.h"
+#include "store.h"
+#include "sha256.h"
+#include "verify.h"
+#include "metrics.h"
 #include "mdex.h"
 
 #define URL "https://api.mangadex.org"
 #define CHAPTERS_REQ_LIMIT 500
+#define GROUPS_REQ_LIMIT 100
 #define NO_GROUP_NAME "No Group"
 #define NO_GROUP_ID 0
-
-#define zipOpenNewFileInZip(Z, N)\
-	zipOpenNewFileInZip((Z), (N), NULL, NULL, 0, NULL, 0, NULL, 0, 0)
+#define DEFAULT_JOBS 4
+#define CHAPTER_LOOKAHEAD 2
+#define TASK_IDLE 0
+#define TASK_LOOKUP 1
+#define TASK_PAGES 2
+#define QUALITY_ORIGINAL 0
+#define QUALITY_SAVER 1
+#define QUALITY_AUTO 2
+#define AUTO_THRESHOLD (256.0 * 1024.0)
+#define AUTO_RESTORE (4.0 * AUTO_THRESHOLD)
+#define AUTO_WEIGHT 0.5
+#define PAGE_UNCHECKED 0
+#define PAGE_STORED 1
+#define PAGE_PACKING 2
+#define PAGE_ATTEMPTS 3
 
 typedef struct range {
 	double from, to;
@@ -30,18 +50,12 @@ typedef struct range {
 
 typedef struct group {
 	char uuid[40];
-	char *name;
+	const char *name;
 	unsigned priority;
 } group_t;
 
-static void group_free(group_t *group)
-{
-	free(group->name);
-}
-
 #define VECT_NAME groups
 #define VECT_ELEM group_t
-#define VECT_FREE group_free
 #include "vect.h"
 
 #define VECT_NAME group_ids
@@ -64,7 +78,6 @@ typedef struct chapter {
 static void chapter_delete(chapter_t *chapter)
 {
 	group_ids_free(&chapter->group_ids);
-	free(chapter->title);
 	free(chapter);
 }
 
@@ -83,15 +96,108 @@ static chapter_t *chapter_create(void)
 #define VECT_PASS_VALUE
 #include "vect.h"
 
+typedef struct page {
+	http_xfer_t xfer;
+	spool_t spool;
+	pack_job_t job;
+	const json_t *file;
+	const archive_entry_t *reuse;
+	int packing, stored, attempts;
+} page_t;
+
+typedef struct reader {
+	json_parser_t parser;
+	const buffer_t *resp;
+} reader_t;
+
+typedef struct task {
+	const chapter_t *chapter;
+	char *archive;
+	size_t pages, next, total, jobs, req_state;
+	int state, mode, opened, saver, cached;
+	output_t output;
+	archive_entries_t entries;
+	http_xfer_t xfer;
+	buffer_t req, resp;
+	json_tokens_t tokens;
+	reader_t reader;
+	const json_t *json, *list;
+	json_iter_t files;
+	page_t *slots;
+} task_t;
+
+static void task_release(task_t *task)
+{
+	size_t i;
+	http_cancel(&task->xfer);
+	for (i = 0; task->slots && i < task->jobs; ++i) {
+		http_cancel(&task->slots[i].xfer);
+		pack_cancel(&task->slots[i].job);
+		spool_close(&task->slots[i].spool);
+	}
+	free(task->slots);
+	json_tokens_free(&task->tokens);
+	buffer_free(&task->req);
+	buffer_free(&task->resp);
+	output_abort(&task->output);
+	archive_entries_free(&task->entries);
+	task->slots = NULL;
+	task->json = NULL;
+}
+
+static void task_delete(task_t *task)
+{
+	task_release(task);
+	free(task->archive);
+	free(task);
+}
+
+static task_t *task_create(const chapter_t *chapter, const char *archive)
+{
+	task_t *task = calloc(1, sizeof(*task));
+	if (!task)
+		return NULL;
+	if (!(task->archive = strdup(archive))) {
+		free(task);
+		return NULL;
+	}
+	task->chapter = chapter;
+	task->xfer.done = 1;
+	task->req = buffer_make(0);
+	task->resp = buffer_make(0);
+	task->tokens = json_tokens_make(0);
+	task->entries = archive_entries_make(0);
+	return task;
+}
+
+static size_t task_inflight(const task_t *task)
+{
+	size_t i, n = 0;
+	for (i = 0; task->slots && i < task->jobs; ++i)
+		n += !task->slots[i].xfer.done;
+	return n;
+}
+
+#define VECT_NAME tasks
+#define VECT_ELEM task_t *
+#define VECT_FREE task_delete
+#define VECT_PASS_VALUE
+#include "vect.h"
+
 typedef struct mdex {
 	char uuid[40];
 	char lang[8];
 	char *title;
 	unsigned flags;
+	unsigned jobs;
+	unsigned quality;
+	int saver;
+	double throughput;
 	const char **prefs;
 	groups_t groups;
 	ranges_t ranges;
 	chapters_t chapters;
+	arena_t strings;
 } mdex_t;
 
 static void mdex_delete(mdex_t *mdex)
@@ -100,6 +206,7 @@ static void mdex_delete(mdex_t *mdex)
 	groups_free(&mdex->groups);
 	ranges_free(&mdex->ranges);
 	chapters_free(&mdex->chapters);
+	arena_free(&mdex->strings);
 	free(mdex);
 }
 
@@ -108,6 +215,51 @@ static size_t regmatch_size(const regmatch_t *match)
 	return (size_t)(match->rm_eo - match->rm_so);
 }
 
+static size_t reader_write(void *data, const char *ptr, size_t size)
+{
+	reader_t *reader = data;
+	double since = metrics_now();
+	json_feed(&reader->parser, reader->resp->data, reader->resp->n);
+	metrics_stage(METRICS_JSON, since);
+	return size;
+}
+
+static void reader_rewind(void *data)
+{
+	reader_t *reader = data;
+	json_start(&reader->parser, reader->parser.tokens);
+}
+
+static http_sink_t reader_start(reader_t *reader, json_tokens_t *tokens, const buffer_t *resp)
+{
+	http_sink_t tap;
+	json_start(&reader->parser, tokens);
+	reader->resp = resp;
+	tap.write = reader_write;
+	tap.rewind = reader_rewind;
+	tap.validate = NULL;
+	tap.data = reader;
+	return tap;
+}
+
+static const json_t *reader_finish(reader_t *reader)
+{
+	double since = metrics_now();
+	const json_t *json = json_finish(&reader->parser, reader->resp->data, reader->resp->n);
+	metrics_stage(METRICS_JSON, since);
+	return json;
+}
+
+static const json_t *fetch(json_tokens_t *tokens, const char *url, buffer_t *resp)
+{
+	reader_t reader;
+	http_sink_t tap = reader_start(&reader, tokens, resp);
+	buffer_rewind(resp, 0);
+	if (http_get(HTTP_API, url, NULL, NULL, resp, &tap))
+		return NULL;
+	return reader_finish(&reader);
+}
+
 static int parse_uuid(mdex_t *mdex, const char *series)
 {
 	static const char pattern[] =
@@ -187,6 +339,20 @@ static unsigned get_group_priority(mdex_t *mdex, const char *name)
 	return 0;
 }
 
+static int parse_quality(mdex_t *mdex, const char *quality)
+{
+	if (!quality || !strcmp(quality, "original"))
+		mdex->quality = QUALITY_ORIGINAL;
+	else if (!strcmp(quality, "saver"))
+		mdex->quality = QUALITY_SAVER;
+	else if (!strcmp(quality, "auto"))
+		mdex->quality = QUALITY_AUTO;
+	else
+		return ERROR;
+	mdex->saver = mdex->quality == QUALITY_SAVER;
+	return OK;
+}
+
 static void replace_slashes(char *s)
 {
 	for (; *s; ++s) if (*s == '/') *s = '|';
@@ -212,18 +378,23 @@ static mdex_t *mdex_create(const mdex_args_t *args)
 	mdex->groups = groups_make(0);
 	mdex->ranges = ranges_make(0);
 	mdex->chapters = chapters_make(0);
+	mdex->strings = arena_make();
 	if (parse_uuid(mdex, args->series)) {
 		puts("Failed to parse uuid");
 		goto cleanup;
 	} else if (parse_ranges(mdex, args->ranges)) {
 		puts("Failed to parse chapter ranges");
 		goto cleanup;
+	} else if (parse_quality(mdex, args->quality)) {
+		puts("Failed to parse quality");
+		goto cleanup;
 	}
 	mdex->flags = args->flags;
+	mdex->jobs = args->jobs ? args->jobs : DEFAULT_JOBS;
 	mdex->prefs = args->groups ? args->groups : &null;
 	strncat(mdex->lang, lang, SIZEOF(mdex->lang) - 1);
 	if (groups_reserve(&mdex->groups, 1) ||
-	    !(no_group.name = strdup(NO_GROUP_NAME))) {
+	    !(no_group.name = arena_intern(&mdex->strings, NO_GROUP_NAME, strlen(NO_GROUP_NAME)))) {
 		puts("Out of memory");
 		goto cleanup;
 	}
@@ -238,60 +409,44 @@ cleanup:
 static int get_title(mdex_t *mdex)
 {
 	int result = ERROR;
-	const json_t *title;
-	json_t *json = NULL;
+	const json_t *json, *title;
+	json_tokens_t tokens = json_tokens_make(0);
 	buffer_t req = buffer_make(0);
 	buffer_t resp = buffer_make(0);
 	if (buffer_append(&req, URL) ||
 	    buffer_append(&req, "/manga/") ||
 	    buffer_append(&req, mdex->uuid) ||
-	    http_get(req.data, NULL, NULL, &resp) ||
-	    !(json = json_parse(resp.data, resp.n)) ||
+	    !(json = fetch(&tokens, req.data, &resp)) ||
 	    !(title = json_find_string(resp.data, json, "data.attributes.title.en")) ||
 	    !(mdex->title = json_strdup(resp.data, title)))
 		goto cleanup;
 	replace_slashes(mdex->title);
 	result = OK;
 cleanup:
-	free(json);
+	json_tokens_free(&tokens);
 	buffer_free(&resp);
 	buffer_free(&req);
 	return result;
 }
 
-static int fetch_group_id(mdex_t *mdex, const char *data, const json_t *uuid, size_t *group_id)
+static const char *intern_name(arena_t *arena, const char *data, const json_t *token)
 {
-	int result = ERROR;
-	group_t group = {0};
-	buffer_t req = buffer_make(0);
-	buffer_t resp = buffer_make(0);
-	json_t *json = NULL;
-	const json_t *name;
-	if (buffer_append(&req, URL) ||
-	    buffer_append(&req, "/group/") ||
-	    buffer_strcpy(&req, data + uuid->start, json_size(uuid)) ||
-	    http_get(req.data, NULL, NULL, &resp) ||
-	    !(json = json_parse(resp.data, resp.n)) ||
-	    !(name = json_find(resp.data, json, "data.attributes.name")) ||
-	    !(group.name = json_strdup(resp.data, name)))
-		goto cleanup;
-	replace_slashes(group.name);
-	group.priority = get_group_priority(mdex, group.name);
-	json_strcpy(data, uuid, group.uuid, SIZEOF(group.uuid));
-	if (groups_push(&mdex->groups, &group))
-		goto cleanup;
-	*group_id = mdex->groups.n - 1;
-	result = OK;
-cleanup:
-	free(json);
-	buffer_free(&resp);
-	buffer_free(&req);
-	return result;
+	const char *name;
+	char *str;
+	if (!memchr(data + token->start, '/', json_size(token)))
+		return json_intern(arena, data, token);
+	if (!(str = json_strdup(data, token)))
+		return NULL;
+	replace_slashes(str);
+	name = arena_intern(arena, str, strlen(str));
+	free(str);
+	return name;
 }
 
 static int get_group_id(mdex_t *mdex, const char *data, const json_t *uuid, size_t *group_id)
 {
 	groups_t *groups = &mdex->groups;
+	group_t group = {0};
 	size_t i, n;
 	for (i = 0, n = groups->n; i < n; ++i) {
 		if (json_eq(data, uuid, groups->data[i].uuid)) {
@@ -299,59 +454,75 @@ static int get_group_id(mdex_t *mdex, const char *data, const json_t *uuid, size
 			return OK;
 		}
 	}
-	return fetch_group_id(mdex, data, uuid, group_id);
+	json_strcpy(data, uuid, group.uuid, SIZEOF(group.uuid));
+	if (groups_push(groups, &group))
+		return ERROR;
+	*group_id = groups->n - 1;
+	return OK;
 }
 
+#define FIELDS_NAME chapter_fields
+#define FIELDS_LIST(X) \
+	X(id, "id") \
+	X(number, "attributes.chapter") \
+	X(version, "attributes.version") \
+	X(volume, "attributes.volume") \
+	X(pages, "attributes.pages") \
+	X(title, "attributes.title") \
+	X(external, "attributes.externalUrl") \
+	X(relationships, "relationships")
+#include "fields.h"
+
+#define FIELDS_NAME relationship_fields
+#define FIELDS_LIST(X) \
+	X(type, "type") \
+	X(id, "id") \
+	X(name, "attributes.name")
+#include "fields.h"
+
+#define FIELDS_NAME group_fields
+#define FIELDS_LIST(X) \
+	X(id, "id") \
+	X(name, "attributes.name")
+#include "fields.h"
+
 static int parse_chapter(mdex_t *mdex, const char *data, const json_t *json)
 {
 	size_t group_id;
-	group_ids_iter_t group_ids;
-	const json_t *field, *relationship;
+	group_t *group;
+	chapter_fields_t fields;
+	relationship_fields_t related;
+	const json_t *relationship;
 	json_iter_t relationships;
 	chapter_t *chapter;
-	if (json_find_string(data, json, "attributes.externalUrl"))
+	chapter_fields_find(data, json, &fields);
+	if (fields.external && fields.external->type == JSON_STRING)
 		return OK;
 	if (!(chapter = chapter_create()))
 		return ERROR;
-	if (!(field = json_find(data, json, "id")))
-		goto cleanup;
-	json_strcpy(data, field, chapter->uuid, SIZEOF(chapter->uuid));
-	if (!(field = json_find(data, json, "attributes.chapter")))
-		goto cleanup;
-	chapter->number = json_double(data, field);
-	if (!(field = json_find(data, json, "attributes.version")))
+	if (!fields.id || !fields.number || !fields.version ||
+	    !fields.volume || !fields.pages || !fields.relationships)
 		goto cleanup;
-	chapter->version = json_uint(data, field);
-	if (!(field = json_find(data, json, "attributes.volume")))
-		goto cleanup;
-	chapter->volume = json_uint(data, field);
-	if (!(field = json_find(data, json, "attributes.pages")))
-		goto cleanup;
-	chapter->pages = json_uint(data, field);
+	json_strcpy(data, fields.id, chapter->uuid, SIZEOF(chapter->uuid));
+	chapter->number = json_double(data, fields.number);
+	chapter->version = json_uint(data, fields.version);
+	chapter->volume = json_uint(data, fields.volume);
+	chapter->pages = json_uint(data, fields.pages);
 	if (mdex->flags & MDEX_CHAPTITLE) {
-		if (!(field = json_find(data, json, "attributes.title")) ||
-		    !(chapter->title = json_strdup(data, field)))
+		if (!fields.title || !(chapter->title = json_arena_strdup(&mdex->strings, data, fields.title)))
 			goto cleanup;
 		replace_slashes(chapter->title);
 	}
-	if (!(field = json_find(data, json, "relationships")))
-		goto cleanup;
-	relationships = json_iter(field);
-	while (json_next(&relationship, &relationships))
-		if (!(field = json_find(data, relationship, "type")) ||
-		    !json_eq(data, field, "scanlation_group") ||
-		    !(field = json_find(data, relationship, "id")) ||
-		    get_group_id(mdex, data, field, &group_id) ||
+	relationships = json_iter(fields.relationships);
+	while (json_next(&relationship, &relationships)) {
+		relationship_fields_find(data, relationship, &related);
+		if (!related.type || !json_eq(data, related.type, "scanlation_group") || !related.id ||
+		    get_group_id(mdex, data, related.id, &group_id) ||
 		    group_ids_push(&chapter->group_ids, group_id))
 			continue;
-	if (!chapter->group_ids.n)
-		if (group_ids_push(&chapter->group_ids, NO_GROUP_ID))
-			goto cleanup;
-	group_ids = group_ids_iter(&chapter->group_ids);
-	while (group_ids_next(&group_id, &group_ids)) {
-		group_t *group = &mdex->groups.data[group_id];
-		if (chapter->priority < group->priority)
-			chapter->priority = group->priority;
+		group = &mdex->groups.data[group_id];
+		if (!group->name && related.name && related.name->type == JSON_STRING)
+			group->name = intern_name(&mdex->strings, data, related.name);
 	}
 	if (chapters_push(&mdex->chapters, chapter))
 		goto cleanup;
@@ -371,16 +542,100 @@ static int parse_chapters(mdex_t *mdex, const char *data, const json_t *json)
 	return OK;
 }
 
+static void name_group(mdex_t *mdex, const char *data, const json_t *json)
+{
+	groups_t *groups = &mdex->groups;
+	group_fields_t fields;
+	size_t i;
+	group_fields_find(data, json, &fields);
+	if (!fields.id || !fields.name || fields.name->type != JSON_STRING)
+		return;
+	for (i = 0; i < groups->n; ++i)
+		if (!groups->data[i].name && json_eq(data, fields.id, groups->data[i].uuid))
+			groups->data[i].name = intern_name(&mdex->strings, data, fields.name);
+}
+
+static int name_groups(mdex_t *mdex)
+{
+	int result = ERROR;
+	const json_t *json, *field, *group;
+	json_iter_t it;
+	groups_t *groups = &mdex->groups;
+	json_tokens_t tokens = json_tokens_make(0);
+	size_t i = 0, n;
+	buffer_t req = buffer_make(0);
+	buffer_t resp = buffer_make(0);
+	while (i < groups->n) {
+		buffer_rewind(&req, 0);
+		if (buffer_append(&req, URL) ||
+		    buffer_append(&req, "/group?limit="STR(GROUPS_REQ_LIMIT)))
+			goto cleanup;
+		for (n = 0; i < groups->n && n < GROUPS_REQ_LIMIT; ++i) {
+			if (groups->data[i].name)
+				continue;
+			if (buffer_append(&req, "&ids[]=") ||
+			    buffer_append(&req, groups->data[i].uuid))
+				goto cleanup;
+			++n;
+		}
+		if (!n)
+			continue;
+		if (!(json = fetch(&tokens, req.data, &resp)) ||
+		    !(field = json_find_array(resp.data, json, "data")))
+			goto cleanup;
+		it = json_iter(field);
+		while (json_next(&group, &it))
+			name_group(mdex, resp.data, group);
+	}
+	result = OK;
+cleanup:
+	json_tokens_free(&tokens);
+	buffer_free(&resp);
+	buffer_free(&req);
+	return result;
+}
+
+static int rank_chapters(mdex_t *mdex)
+{
+	size_t i, j, group_id;
+	group_t *group;
+	chapter_t *chapter;
+	group_ids_t *ids;
+	if (name_groups(mdex))
+		return ERROR;
+	for (i = 0; i < mdex->groups.n; ++i) {
+		group = &mdex->groups.data[i];
+		if (group->name)
+			group->priority = get_group_priority(mdex, group->name);
+	}
+	for (i = 0; i < mdex->chapters.n; ++i) {
+		chapter = mdex->chapters.data[i];
+		ids = &chapter->group_ids;
+		for (j = group_id = 0; j < ids->n; ++j)
+			if (mdex->groups.data[ids->data[j]].name)
+				ids->data[group_id++] = ids->data[j];
+		ids->n = group_id;
+		if (!ids->n && group_ids_push(ids, NO_GROUP_ID))
+			return ERROR;
+		for (j = 0; j < ids->n; ++j) {
+			group = &mdex->groups.data[ids->data[j]];
+			if (chapter->priority < group->priority)
+				chapter->priority = group->priority;
+		}
+	}
+	return OK;
+}
+
 static int get_chapters(mdex_t *mdex)
 {
 	static const char req_params[] =
 		"/feed?order[volume]=asc&order[chapter]=asc&limit="STR(CHAPTERS_REQ_LIMIT)
 		"&contentRating[]=safe&contentRating[]=suggestive"
 		"&contentRating[]=erotica&contentRating[]=pornographic"
-		"&translatedLanguage[]=";
+		"&includes[]=scanlation_group&translatedLanguage[]=";
 	int result = ERROR;
-	json_t *json = NULL;
-	const json_t *field;
+	const json_t *json, *field;
+	json_tokens_t tokens = json_tokens_make(0);
 	size_t req_buffer_state;
 	size_t offset = 0, total = 0;
 	buffer_t req = buffer_make(0);
@@ -395,8 +650,7 @@ static int get_chapters(mdex_t *mdex)
 	req_buffer_state = req.n;
 	do {
 		if (buffer_append_ulong(&req, offset, 0) ||
-		    http_get(req.data, NULL, NULL, &resp) ||
-		    !(json = json_parse(resp.data, resp.n)))
+		    !(json = fetch(&tokens, req.data, &resp)))
 			goto cleanup;
 		if (!total)
 			if (!(field = json_find_number(resp.data, json, "total")) ||
@@ -408,13 +662,12 @@ static int get_chapters(mdex_t *mdex)
 			goto cleanup;
 		offset += CHAPTERS_REQ_LIMIT;
 		buffer_rewind(&req, req_buffer_state);
-		buffer_rewind(&resp, 0);
-		free(json);
-		json = NULL;
 	} while (offset < total);
+	if (rank_chapters(mdex))
+		goto cleanup;
 	result = OK;
 cleanup:
-	free(json);
+	json_tokens_free(&tokens);
 	buffer_free(&resp);
 	buffer_free(&req);
 	return result;
@@ -543,154 +796,465 @@ static int get_file_name(buffer_t *buf, const mdex_t *mdex, const chapter_t *cha
 		if (buffer_append(buf, "]"))
 			return ERROR;
 	}
-	if (buffer_append(buf, ".cbz"))
+	if (buffer_append(buf, output_suffix()))
 		return ERROR;
 	return OK;
 }
 
-static int get_pages_in_file(const char *archive, size_t *pages)
+static int get_page_name(buffer_t *buf, const task_t *task, const json_t *file, size_t page)
 {
-	int result = ERROR;
-	unzFile unzip;
-	unz_global_info info;
-	if (!(unzip = unzOpen(archive)))
+	unsigned pos;
+	const char *data = task->resp.data;
+	if (buffer_append_double(buf, task->chapter->number, 3, 5) ||
+	    buffer_append(buf, "-") ||
+	    buffer_append_ulong(buf, page, 3))
+		return ERROR;
+	for (pos = file->end; pos-- > file->start;)
+		if (data[pos] == '.')
+			return buffer_strcpy(buf, data + pos, (size_t)(file->end - pos));
+	return OK;
+}
+
+static const archive_entry_t *find_entry(const task_t *task, const char *key, const char *name)
+{
+	size_t i;
+	const archive_entry_t *entry;
+	for (i = 0; i < task->entries.n; ++i) {
+		entry = &task->entries.data[i];
+		if (entry->valid && !strcmp(entry->key[0] ? key : name, entry->key[0] ? entry->key : entry->name))
+			return entry;
+	}
+	return NULL;
+}
+
+static int save_page(output_t *output, const char *name, const char *key, page_t *page)
+{
+	int result;
+	double since = metrics_now();
+	spool_t *packed = NULL;
+	if (page->reuse) {
+		result = output_copy(output, name, key, page->reuse);
+	} else {
+		if (page->packing == PAGE_PACKING && !page->job.result &&
+		    page->job.out.size < page->spool.size)
+			packed = &page->job.out;
+		result = output_add(output, name, key, &page->spool, packed);
+	}
+	metrics_stage(METRICS_ZIP, since);
+	return result;
+}
+
+static void measure(mdex_t *mdex, size_t bytes, long elapsed)
+{
+	double rate;
+	if (mdex->quality != QUALITY_AUTO || elapsed <= 0 || !bytes)
+		return;
+	rate = (double)bytes * 1000.0 / (double)elapsed;
+	if (mdex->throughput > 0.0)
+		rate = AUTO_WEIGHT * rate + (1.0 - AUTO_WEIGHT) * mdex->throughput;
+	mdex->throughput = rate;
+	if (!mdex->saver && rate < AUTO_THRESHOLD)
+		mdex->saver = 1;
+	else if (mdex->saver && rate > AUTO_RESTORE)
+		mdex->saver = 0;
+}
+
+static int lookup_task(task_t *task)
+{
+	http_sink_t tap = reader_start(&task->reader, &task->tokens, &task->resp);
+	buffer_rewind(&task->req, 0);
+	buffer_rewind(&task->resp, 0);
+	if (buffer_append(&task->req, URL) ||
+	    buffer_append(&task->req, "/at-home/server/") ||
+	    buffer_append(&task->req, task->chapter->uuid) ||
+	    http_start(&task->xfer, HTTP_ATHOME, task->req.data, NULL, NULL, &task->resp, &tap))
 		return ERROR;
-	if (unzGetGlobalInfo(unzip, &info))
+	return OK;
+}
+
+static int start_task(const mdex_t *mdex, task_t *task)
+{
+	size_t i;
+	if (!(task->slots = calloc(mdex->jobs, sizeof(*task->slots))))
+		return ERROR;
+	task->jobs = mdex->jobs;
+	for (i = 0; i < task->jobs; ++i)
+		task->slots[i].xfer.done = 1;
+	task->state = TASK_LOOKUP;
+	if (!store_load(task->chapter->uuid, task->chapter->version, &task->resp)) {
+		reader_start(&task->reader, &task->tokens, &task->resp);
+		task->cached = 1;
+		return OK;
+	}
+	return lookup_task(task);
+}
+
+static int stored_files(const char *data, const json_t *files)
+{
+	const json_t *file;
+	json_iter_t it = json_iter(files);
+	while (json_next(&file, &it))
+		if (!store_has(data + file->start, json_size(file)))
+			return 0;
+	return 1;
+}
+
+static int has_file(const char *data, const json_t *files, const char *key)
+{
+	const json_t *file;
+	json_iter_t it = json_iter(files);
+	size_t n = strlen(key);
+	while (json_next(&file, &it))
+		if (json_size(file) == n && !memcmp(data + file->start, key, n))
+			return 1;
+	return 0;
+}
+
+static int resolve_task(const mdex_t *mdex, task_t *task)
+{
+	int result = ERROR;
+	char *base_url = NULL;
+	const char *data = task->resp.data;
+	const json_t *base, *hash, *files, *other;
+	task->saver = mdex->saver;
+	if (task->xfer.result ||
+	    !(task->json = reader_finish(&task->reader)) ||
+	    !(base = json_find_string(data, task->json, "baseUrl")) ||
+	    !(hash = json_find_string(data, task->json, "chapter.hash")) ||
+	    !(files = json_find_array(data, task->json, task->saver ? "chapter.dataSaver" : "chapter.data")) ||
+	    !(base_url = json_strdup(data, base)))
+		goto cleanup;
+	if (mdex->quality == QUALITY_AUTO && task->entries.n &&
+	    (other = json_find_array(data, task->json, task->saver ? "chapter.data" : "chapter.dataSaver")) &&
+	    has_file(data, other, task->entries.data[0].key)) {
+		task->saver = !task->saver;
+		files = other;
+	}
+	if (task->cached && !stored_files(data, files)) {
+		task->json = NULL;
+		task->cached = 0;
+		result = lookup_task(task);
+		goto cleanup;
+	}
+	if (!task->cached) {
+		http_prewarm(base_url);
+		if (store_save(task->chapter->uuid, task->chapter->version, &task->resp))
+			goto cleanup;
+	}
+	buffer_rewind(&task->req, 0);
+	if (buffer_append(&task->req, base_url) ||
+	    buffer_append(&task->req, task->saver ? "/data-saver/" : "/data/") ||
+	    buffer_strcpy(&task->req, data + hash->start, json_size(hash)) ||
+	    buffer_append(&task->req, "/"))
 		goto cleanup;
-	*pages = info.number_entry;
+	task->req_state = task->req.n;
+	task->total = json_count(files);
+	task->list = files;
+	task->files = json_iter(files);
+	task->state = TASK_PAGES;
 	result = OK;
 cleanup:
-	unzClose(unzip);
+	free(base_url);
 	return result;
 }
 
-static int save_page(const char *archive, const char *name, const char *data, size_t size)
+static int launch_pages(const mdex_t *mdex, task_t *task, size_t *inflight)
 {
 	int result = ERROR;
-	zipFile zip;
-	if (!(zip = zipOpen(archive, APPEND_STATUS_ADDINZIP)))
-		return ERROR;
-	if (zipOpenNewFileInZip(zip, name))
-		goto cleanup_zip;
-	if (zipWriteInFileInZip(zip, data, (unsigned)size))
-		goto cleanup_file;
+	size_t jobs = mdex->jobs;
+	page_t *page;
+	buffer_t part = buffer_make(0);
+	for (; task->next < task->total && task->next - task->pages < jobs && *inflight < jobs; ++task->next) {
+		http_sink_t sink;
+		buffer_t *req = &task->req;
+		page = &task->slots[task->next % jobs];
+		buffer_rewind(&part, 0);
+		if (!json_next(&page->file, &task->files) ||
+		    buffer_strcpy(req, task->resp.data + page->file->start, json_size(page->file)))
+			goto cleanup;
+		if (task->entries.n) {
+			if (get_page_name(&part, task, page->file, task->next + 1))
+				goto cleanup;
+			page->reuse = find_entry(task, req->data + task->req_state, part.data);
+			buffer_rewind(&part, 0);
+			if (page->reuse) {
+				buffer_rewind(req, task->req_state);
+				continue;
+			}
+		}
+		if (!store_open(&page->spool, req->data + task->req_state, json_size(page->file))) {
+			page->stored = 1;
+			buffer_rewind(req, task->req_state);
+			continue;
+		}
+		if (output_streaming()) {
+			if (spool_open(&page->spool, NULL, NULL))
+				goto cleanup;
+		} else if (buffer_append(&part, task->archive) ||
+		           buffer_append(&part, ".") ||
+		           buffer_append_ulong(&part, task->next + 1, 3) ||
+		           buffer_append(&part, ".part") ||
+		           spool_open(&page->spool, part.data, req->data + task->req_state)) {
+			goto cleanup;
+		}
+		if (page->spool.size && sha256_hex(req->data + task->req_state, json_size(page->file)) &&
+		    sha256_match(&page->spool.sha, req->data + task->req_state, json_size(page->file))) {
+			buffer_rewind(req, task->req_state);
+			continue;
+		}
+		sink = spool_sink(&page->spool);
+		if (http_resume(&page->xfer, HTTP_IMAGE, req->data, NULL, &sink, page->spool.size, page->spool.validator))
+			goto cleanup;
+		buffer_rewind(req, task->req_state);
+		++*inflight;
+	}
 	result = OK;
-cleanup_file:
-	zipCloseFileInZip(zip);
-cleanup_zip:
-	zipClose(zip, NULL);
+cleanup:
+	buffer_free(&part);
+	return result;
+}
+
+static int check_page(task_t *task, page_t *page)
+{
+	int result;
+	http_sink_t sink;
+	const json_t *file = page->file;
+	if (page->stored || sha256_match(&page->spool.sha, task->resp.data + file->start, json_size(file)))
+		return OK;
+	if (++page->attempts >= PAGE_ATTEMPTS ||
+	    buffer_strcpy(&task->req, task->resp.data + file->start, json_size(file)))
+		return ERROR;
+	spool_rewind(&page->spool);
+	sink = spool_sink(&page->spool);
+	result = http_resume(&page->xfer, HTTP_IMAGE, task->req.data, NULL, &sink, 0, "");
+	buffer_rewind(&task->req, task->req_state);
 	return result;
 }
 
-static int save_pages(const char *archive, const chapter_t *chapter, size_t pages)
+static int pack_pages(task_t *task, size_t *fetched)
+{
+	size_t i;
+	int level;
+	page_t *page;
+	for (i = task->pages; i < task->next; ++i) {
+		page = &task->slots[i % task->jobs];
+		if (page->reuse || page->packing != PAGE_UNCHECKED || !page->xfer.done || page->xfer.result)
+			continue;
+		if (check_page(task, page))
+			return ERROR;
+		if (!page->xfer.done)
+			continue;
+		if (!page->stored)
+			*fetched += page->spool.size;
+		page->packing = PAGE_STORED;
+		if (!(level = pack_level(&page->spool)))
+			continue;
+		if (pack_submit(&page->job, &page->spool, level))
+			return ERROR;
+		page->packing = PAGE_PACKING;
+	}
+	return OK;
+}
+
+static int copy_recovered(task_t *task)
 {
 	int result = ERROR;
-	char *base_url = NULL;
-	const json_t *base, *hash, *data, *file;
-	size_t page = 0, req_buffer_state, name_buffer_state;
-	json_t *json = NULL;
-	json_iter_t files;
-	buffer_t buf = buffer_make(0);
-	buffer_t req = buffer_make(0);
-	buffer_t resp = buffer_make(0);
+	size_t page = 0;
+	const json_t *file;
+	const archive_entry_t *entry;
+	json_iter_t it = json_iter(task->list);
 	buffer_t name = buffer_make(0);
-	printf("\33[2K\r%s: %lu/%u", archive, pages, chapter->pages);
-	fflush(stdout);
-	if (buffer_append(&req, URL) ||
-	    buffer_append(&req, "/at-home/server/") ||
-	    buffer_append(&req, chapter->uuid) ||
-	    http_get(req.data, NULL, NULL, &resp) ||
-	    !(json = json_parse(resp.data, resp.n)) ||
-	    !(base = json_find_string(resp.data, json, "baseUrl")) ||
-	    !(hash = json_find_string(resp.data, json, "chapter.hash")) ||
-	    !(data = json_find_array(resp.data, json, "chapter.data")) ||
-	    !(base_url = json_strdup(resp.data, base)))
-		goto cleanup;
-	buffer_rewind(&req, 0);
-	if (buffer_append(&req, base_url) ||
-	    buffer_append(&req, "/data/") ||
-	    buffer_strcpy(&req, resp.data + hash->start, json_size(hash)) ||
-	    buffer_append(&req, "/"))
-		goto cleanup;
-	req_buffer_state = req.n;
-	if (buffer_append_double(&name, chapter->number, 3, 5) ||
-	    buffer_append(&name, "-"))
-		goto cleanup;
-	name_buffer_state = name.n;
-	files = json_iter(data);
-	while (json_next(&file, &files)) {
-		int pos;
-		const char *dot;
-		if (page++ < pages)
-			continue;
-		if (buffer_strcpy(&req, resp.data + file->start, json_size(file)) ||
-		    http_get(req.data, NULL, NULL, &buf))
+	buffer_t key = buffer_make(0);
+	while (json_next(&file, &it)) {
+		buffer_rewind(&name, 0);
+		buffer_rewind(&key, 0);
+		if (get_page_name(&name, task, file, ++page) ||
+		    buffer_strcpy(&key, task->resp.data + file->start, json_size(file)))
 			goto cleanup;
-		for (dot = NULL, pos = file->end; pos-- > file->start;) {
-			if (resp.data[pos] == '.') {
-				dot = resp.data + pos;
+		if ((entry = find_entry(task, key.data, name.data)) &&
+		    output_copy(&task->output, name.data, key.data, entry))
+			goto cleanup;
+	}
+	result = OK;
+cleanup:
+	buffer_free(&key);
+	buffer_free(&name);
+	return result;
+}
+
+static int open_task(task_t *task)
+{
+	if (output_open(&task->output, task->archive, task->mode))
+		return ERROR;
+	task->opened = 1;
+	if (task->mode == ARCHIVE_RECOVER && copy_recovered(task))
+		return ERROR;
+	printf("\33[2K\r%s: %lu/%lu%s", task->archive, task->pages, task->total,
+	       task->saver ? " (data-saver)" : "");
+	fflush(stdout);
+	return OK;
+}
+
+static int commit_pages(const mdex_t *mdex, task_t *task, size_t *committed)
+{
+	int result = ERROR;
+	const json_t *file;
+	page_t *page;
+	buffer_t name = buffer_make(0);
+	buffer_t key = buffer_make(0);
+	*committed = 0;
+	while (task->pages < task->next) {
+		page = &task->slots[task->pages % mdex->jobs];
+		if (!page->reuse) {
+			if (!page->xfer.done)
+				break;
+			if (page->xfer.result)
+				goto cleanup;
+			if (page->packing == PAGE_UNCHECKED ||
+			    (page->packing == PAGE_PACKING && !pack_done(&page->job)))
 				break;
-			}
 		}
-		if (buffer_append_ulong(&name, page, 3))
+		file = page->file;
+		buffer_rewind(&name, 0);
+		buffer_rewind(&key, 0);
+		if (get_page_name(&name, task, file, ++task->pages) ||
+		    buffer_strcpy(&key, task->resp.data + file->start, json_size(file)))
 			goto cleanup;
-		if (dot && buffer_strcpy(&name, dot, (size_t)(file->end - pos)))
+		if (!page->reuse && !page->stored && store_put(&page->spool, key.data, key.n))
 			goto cleanup;
-		if (save_page(archive, name.data, buf.data, buf.n))
+		if (!(page->reuse && task->mode == ARCHIVE_RECOVER) &&
+		    save_page(&task->output, name.data, key.data, page))
 			goto cleanup;
-		printf("\33[2K\r%s: %lu/%lu", archive, page, json_count(data));
+		printf("\33[2K\r%s: %lu/%lu%s", task->archive, task->pages, task->total,
+		       task->saver ? " (data-saver)" : "");
 		fflush(stdout);
-		buffer_rewind(&buf, 0);
-		buffer_rewind(&req, req_buffer_state);
-		buffer_rewind(&name, name_buffer_state);
+		pack_cancel(&page->job);
+		page->packing = PAGE_UNCHECKED;
+		page->reuse = NULL;
+		page->stored = 0;
+		page->attempts = 0;
+		spool_remove(&page->spool);
+		++*committed;
 	}
 	result = OK;
 cleanup:
-	putchar('\n');
-	free(json);
-	free(base_url);
+	buffer_free(&key);
 	buffer_free(&name);
-	buffer_free(&resp);
-	buffer_free(&req);
-	buffer_free(&buf);
 	return result;
 }
 
-static int save_chapter(const char *archive, const chapter_t *chapter, int resume, int checkonly)
+static int save_tasks(mdex_t *mdex, const tasks_t *tasks)
 {
-	size_t pages = 0;
-	zipFile zip;
-	if (!resume || get_pages_in_file(archive, &pages)) {
-		if (checkonly) {
-			printf("Download: %s\n", archive);
-			return OK;
+	int result = ERROR;
+	size_t i, end, inflight, committed = 0, head = 0, fetched = 0;
+	long active = 0, since;
+	task_t *task;
+	while (head < tasks->n) {
+		end = head + 1 + CHAPTER_LOOKAHEAD < tasks->n ? head + 1 + CHAPTER_LOOKAHEAD : tasks->n;
+		for (inflight = 0, i = head; i < end; ++i)
+			inflight += task_inflight(tasks->data[i]);
+		for (i = head; i < end; ++i) {
+			task = tasks->data[i];
+			if (task->state == TASK_IDLE && start_task(mdex, task))
+				goto cleanup;
+			if (task->state == TASK_LOOKUP && task->xfer.done && resolve_task(mdex, task))
+				goto cleanup;
+			if (task->state == TASK_PAGES &&
+			    (launch_pages(mdex, task, &inflight) || pack_pages(task, &fetched)))
+				goto cleanup;
 		}
-		if (!(zip = zipOpen(archive, APPEND_STATUS_CREATE)))
-			return ERROR;
-		zipClose(zip, NULL);
-	}
-	if (pages < chapter->pages) {
-		if (checkonly) {
-			printf("Resume:   %s\n", archive);
-			return OK;
+		task = tasks->data[head];
+		if (task->state == TASK_PAGES && !task->opened && open_task(task))
+			goto cleanup;
+		if (task->state == TASK_PAGES && commit_pages(mdex, task, &committed))
+			goto cleanup;
+		if (task->state == TASK_PAGES && task->pages >= task->total) {
+			putchar('\n');
+			if (output_close(&task->output))
+				goto cleanup;
+			measure(mdex, fetched, active);
+			fetched = 0;
+			active = 0;
+			task_release(task);
+			++head;
+		} else if (!(task->state == TASK_PAGES && committed)) {
+			since = mclock();
+			if (http_poll())
+				goto cleanup;
+			if (inflight)
+				active += mclock() - since;
 		}
-		if (save_pages(archive, chapter, pages))
-			return ERROR;
 	}
-	return OK;
+	result = OK;
+cleanup:
+	if (result && head < tasks->n && tasks->data[head]->opened)
+		putchar('\n');
+	return result;
 }
 
-static int save_chapters(const mdex_t *mdex)
+static int plan_chapter(const mdex_t *mdex, tasks_t *tasks, const char *archive, const chapter_t *chapter, int resume)
+{
+	int result = ERROR;
+	size_t i, valid = 0;
+	task_t *task = NULL;
+	archive_entries_t entries = archive_entries_make(0);
+	int checkonly = mdex->flags & MDEX_CHECKONLY;
+	int mode = resume ? ARCHIVE_RESUME : ARCHIVE_CREATE;
+	if (resume && archive_scan(archive, &entries)) {
+		archive_entries_free(&entries);
+		entries = archive_entries_make(0);
+		mode = ARCHIVE_CREATE;
+	}
+	if (mode == ARCHIVE_CREATE && output_resumable()) {
+		if (archive_recover(archive, &entries))
+			goto cleanup;
+		if (entries.n)
+			mode = ARCHIVE_RECOVER;
+	}
+	for (i = 0; i < entries.n; ++i)
+		if (entries.data[i].valid)
+			++valid;
+	if (mode == ARCHIVE_RESUME && valid == entries.n && valid >= chapter->pages) {
+		result = OK;
+		goto cleanup;
+	}
+	if (checkonly) {
+		printf(valid < entries.n ? "Repair:   %s\n" : mode != ARCHIVE_CREATE ?
+		       "Resume:   %s\n" : "Download: %s\n", archive);
+		result = OK;
+		goto cleanup;
+	}
+	if (!(task = task_create(chapter, archive)))
+		goto cleanup;
+	task->mode = mode;
+	task->entries = entries;
+	entries = archive_entries_make(0);
+	if (tasks_push(tasks, task))
+		goto cleanup;
+	task = NULL;
+	result = OK;
+cleanup:
+	if (task)
+		task_delete(task);
+	archive_entries_free(&entries);
+	return result;
+}
+
+static int save_chapters(mdex_t *mdex)
 {
 	int result = ERROR, has_chapter;
-	int overwrite = mdex->flags & MDEX_OVERWRITE;
+	int streaming = output_streaming();
+	int resumable = output_resumable();
+	int overwrite = (mdex->flags & MDEX_OVERWRITE) || streaming;
 	int checkonly = mdex->flags & MDEX_CHECKONLY;
 	int usesubdir = mdex->flags & MDEX_USESUBDIR;
+	int repair = mdex->flags & MDEX_REPAIR;
 	chapter_t *chapter, *last = NULL;
 	chapters_iter_t chapters = chapters_iter(&mdex->chapters);
+	tasks_t tasks = tasks_make(0);
 	buffer_t name = buffer_make(0);
 	buffer_t last_name = buffer_make(0);
-	if (usesubdir && !checkonly)
+	if (usesubdir && !checkonly && !streaming)
 		if (access(mdex->title, F_OK) && mkdir(mdex->title, 0750))
 			goto cleanup;
 	while ((has_chapter = chapters_next(&chapter, &chapters)) || last) {
@@ -702,46 +1266,107 @@ static int save_chapters(const mdex_t *mdex)
 			goto cleanup;
 		if (!overwrite) {
 			if (!access(name.data, F_OK)) {
-				last = chapter;
+				if (resumable && !repair)
+					last = chapter;
+				else if (resumable && plan_chapter(mdex, &tasks, name.data, chapter, 1))
+					goto cleanup;
 				goto next;
 			} else if (last) check_last: {
 				if (get_file_name(&last_name, mdex, last) ||
-				    save_chapter(last_name.data, last, 1, checkonly))
+				    plan_chapter(mdex, &tasks, last_name.data, last, 1))
 					goto cleanup;
 				last = NULL;
 				buffer_rewind(&last_name, 0);
 			}
 		}
-		if (has_chapter && save_chapter(name.data, chapter, 0, checkonly))
+		if (has_chapter && plan_chapter(mdex, &tasks, name.data, chapter, 0))
 			goto cleanup;
 next:
 		buffer_rewind(&name, 0);
 	}
-	result = OK;
+	result = save_tasks(mdex, &tasks);
 cleanup:
+	tasks_free(&tasks);
 	buffer_free(&last_name);
 	buffer_free(&name);
 	return result;
 }
 
+static int verify_chapters(mdex_t *mdex)
+{
+	int result = ERROR;
+	size_t i, damaged = 0;
+	chapter_t *chapter;
+	chapters_iter_t chapters = chapters_iter(&mdex->chapters);
+	verify_jobs_t jobs = verify_jobs_make(0);
+	buffer_t name = buffer_make(0);
+	if (!output_resumable()) {
+		puts("Only zip archives can be verified");
+		goto cleanup;
+	}
+	while (chapters_next(&chapter, &chapters)) {
+		verify_job_t job = {0};
+		buffer_rewind(&name, 0);
+		if (chapter->skip)
+			continue;
+		if (get_file_name(&name, mdex, chapter))
+			goto cleanup;
+		if (access(name.data, F_OK))
+			continue;
+		if (!(job.path = strdup(name.data)) || verify_jobs_push(&jobs, &job)) {
+			free(job.path);
+			goto cleanup;
+		}
+	}
+	if (verify_run(&jobs))
+		goto cleanup;
+	for (i = 0; i < jobs.n; ++i)
+		if (jobs.data[i].result || jobs.data[i].damaged)
+			++damaged;
+	printf("Verified %lu archives, %lu damaged\n", jobs.n, damaged);
+	result = damaged ? ERROR : OK;
+cleanup:
+	verify_jobs_free(&jobs);
+	buffer_free(&name);
+	return result;
+}
+
 int mdex_download(const mdex_args_t *args)
 {
 	int result = ERROR;
 	mdex_t *mdex = mdex_create(args);
 	if (!mdex)
 		return ERROR;
-	if (!mdex->title && get_title(mdex)) {
+	if (output_init(args->format, args->stream)) {
+		puts("Failed to open output");
+		goto cleanup;
+	} else if (pack_init(output_format() == OUTPUT_ZIP ? args->compression : "0", mdex->jobs)) {
+		puts("Failed to set up page compression");
+		goto cleanup;
+	} else if (store_init(args->store)) {
+		puts("Failed to open page store");
+		goto cleanup;
+	} else if (!mdex->title && get_title(mdex)) {
 		puts("Failed to fetch series title");
 		goto cleanup;
 	} else if (get_chapters(mdex)) {
 		puts("Failed to fetch chapters list");
 		goto cleanup;
+	} else if (mdex->flags & MDEX_VERIFY) {
+		if (!filter_chapters(mdex) && verify_chapters(mdex))
+			goto cleanup;
 	} else if (!filter_chapters(mdex) && save_chapters(mdex)) {
 		puts("Failed to download chapters");
 		goto cleanup;
+	} else if (output_finish()) {
+		puts("Failed to finish output");
+		goto cleanup;
 	}
 	result = OK;
 cleanup:
+	store_free();
+	pack_free();
+	output_free();
 	mdex_delete(mdex);
 	return result;
 }
@@ -6,14 +6,22 @@
 #define MDEX_REPORTDUP (1 << 2)
 #define MDEX_CHECKONLY (1 << 3)
 #define MDEX_CHAPTITLE (1 << 4)
+#define MDEX_REPAIR (1 << 5)
+#define MDEX_VERIFY (1 << 6)
 
 typedef struct mdex_args {
 	const char *series;
 	const char *ranges;
 	const char *title;
 	const char *lang;
+	const char *quality;
+	const char *compression;
+	const char *store;
+	const char *format;
+	const char *stream;
 	const char **groups;
 	unsigned flags;
+	unsigned jobs;
 } mdex_args_t;
 
 int mdex_download(const mdex_args_t *args);
@@ -0,0 +1,156 @@
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include "util.h"
+#include "http.h"
+#include "metrics.h"
+
+typedef struct counters {
+	unsigned long requests, failures, retries;
+	unsigned long histogram[METRICS_BUCKETS];
+	double bytes, dns, connect, tls, ttfb, total;
+	long sleep, backoff;
+} counters_t;
+
+static const char *const class_names[HTTP_CLASSES] = {"api", "at-home", "image"};
+static const char *const stage_names[METRICS_STAGES] = {"json", "zip"};
+
+static counters_t classes[HTTP_CLASSES];
+static double stages[METRICS_STAGES];
+static double started;
+static volatile sig_atomic_t dump;
+
+static void on_signal(int sig)
+{
+	dump = 1;
+}
+
+void metrics_init(void)
+{
+	started = metrics_now();
+	signal(SIGUSR1, on_signal);
+}
+
+double metrics_now(void)
+{
+	struct timespec ts = {0};
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static unsigned bucket(double seconds)
+{
+	unsigned i = 0;
+	long ms = (long)(seconds * 1000.0);
+	for (; ms && i < METRICS_BUCKETS - 1; ms >>= 1)
+		++i;
+	return i;
+}
+
+void metrics_request(unsigned cls, const metrics_sample_t *sample)
+{
+	counters_t *c = &classes[cls];
+	++c->requests;
+	c->failures += sample->failed != 0;
+	c->bytes += sample->bytes;
+	c->dns += sample->dns;
+	c->connect += sample->connect;
+	c->tls += sample->tls;
+	c->ttfb += sample->ttfb;
+	c->total += sample->total;
+	++c->histogram[bucket(sample->total)];
+}
+
+void metrics_retry(unsigned cls, long delay)
+{
+	++classes[cls].retries;
+	classes[cls].backoff += delay;
+}
+
+void metrics_sleep(unsigned cls, long ms)
+{
+	classes[cls].sleep += ms;
+}
+
+void metrics_stage(unsigned stage, double since)
+{
+	stages[stage] += metrics_now() - since;
+}
+
+void metrics_poll(void)
+{
+	if (!dump)
+		return;
+	dump = 0;
+	metrics_print(stderr);
+}
+
+static void percentile(FILE *out, const char *name, const counters_t *c, double rank)
+{
+	unsigned i;
+	unsigned long seen = 0, target = (unsigned long)(rank * (double)c->requests + 0.5);
+	for (i = 0; i < METRICS_BUCKETS - 1; ++i)
+		if ((seen += c->histogram[i]) >= target && seen)
+			break;
+	if (i < METRICS_BUCKETS - 1)
+		fprintf(out, " %s < %ld", name, 1L << i);
+	else
+		fprintf(out, " %s >= %ld", name, 1L << (i - 1));
+}
+
+static double average(double sum, unsigned long n)
+{
+	return n ? 1000.0 * sum / (double)n : 0.0;
+}
+
+void metrics_print(FILE *out)
+{
+	unsigned i;
+	fprintf(out, "\nElapsed: %.3f s\n", metrics_now() - started);
+	for (i = 0; i < HTTP_CLASSES; ++i) {
+		const counters_t *c = &classes[i];
+		if (!c->requests)
+			continue;
+		fprintf(out, "%s: %lu requests, %lu failed, %lu retries, %.2f MiB, %.3f s rate limited, %.3f s backoff\n",
+		        class_names[i], c->requests, c->failures, c->retries, c->bytes / 1048576.0,
+		        (double)c->sleep / 1000.0, (double)c->backoff / 1000.0);
+		fprintf(out, "  avg ms: dns %.1f, connect %.1f, tls %.1f, first byte %.1f, total %.1f\n",
+		        average(c->dns, c->requests), average(c->connect, c->requests), average(c->tls, c->requests),
+		        average(c->ttfb, c->requests), average(c->total, c->requests));
+		fputs("  total ms:", out);
+		percentile(out, "p50", c, 0.5);
+		percentile(out, "p90", c, 0.9);
+		percentile(out, "p99", c, 0.99);
+		fputc('\n', out);
+	}
+	for (i = 0; i < METRICS_STAGES; ++i)
+		fprintf(out, "%s: %.3f s\n", stage_names[i], stages[i]);
+	fflush(out);
+}
+
+int metrics_report(const char *path)
+{
+	unsigned i, j;
+	FILE *out = fopen(path, "w");
+	if (!out)
+		return ERROR;
+	fprintf(out, "{\"elapsed\":%.6f,\"classes\":{", metrics_now() - started);
+	for (i = 0; i < HTTP_CLASSES; ++i) {
+		const counters_t *c = &classes[i];
+		fprintf(out, "%s\"%s\":{\"requests\":%lu,\"failures\":%lu,\"retries\":%lu,\"bytes\":%.0f,"
+		        "\"sleep\":%.3f,\"backoff\":%.3f,\"dns\":%.6f,\"connect\":%.6f,\"tls\":%.6f,"
+		        "\"ttfb\":%.6f,\"total\":%.6f,\"histogram\":[",
+		        i ? "," : "", class_names[i], c->requests, c->failures, c->retries, c->bytes,
+		        (double)c->sleep / 1000.0, (double)c->backoff / 1000.0,
+		        c->dns, c->connect, c->tls, c->ttfb, c->total);
+		for (j = 0; j < METRICS_BUCKETS; ++j)
+			fprintf(out, "%s%lu", j ? "," : "", c->histogram[j]);
+		fputs("]}", out);
+	}
+	fputs("},\"stages\":{", out);
+	for (i = 0; i < METRICS_STAGES; ++i)
+		fprintf(out, "%s\"%s\":%.6f", i ? "," : "", stage_names[i], stages[i]);
+	fputs("}}\n", out);
+	return fclose(out) ? ERROR : OK;
+}
@@ -0,0 +1,34 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdio.h>
+#include "util.h"
+
+#define METRICS_JSON 0
+#define METRICS_ZIP 1
+#define METRICS_STAGES 2
+
+#define METRICS_BUCKETS 16
+
+typedef struct metrics_args {
+	const char *report;
+	int summary;
+} metrics_args_t;
+
+typedef struct metrics_sample {
+	double dns, connect, tls, ttfb, total;
+	double bytes;
+	int failed;
+} metrics_sample_t;
+
+void metrics_init(void);
+double metrics_now(void);
+void metrics_request(unsigned cls, const metrics_sample_t *sample);
+void metrics_retry(unsigned cls, long delay);
+void metrics_sleep(unsigned cls, long ms);
+void metrics_stage(unsigned stage, double since);
+void metrics_poll(void);
+void metrics_print(FILE *out);
+int metrics_report(const char *path);
+
+#endif
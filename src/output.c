@@ -0,0 +1,432 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include "util.h"
+#include "spool.h"
+#include "archive.h"
+#include "output.h"
+
+#define TAR_BLOCK 512
+#define TAR_NAME 100
+#define TAR_PREFIX 155
+#define ZIP_LOCAL 0x04034b50UL
+#define ZIP_CENTRAL 0x02014b50UL
+#define ZIP_END 0x06054b50UL
+#define ZIP_END64 0x06064b50UL
+#define ZIP_LOCATOR 0x07064b50UL
+#define ZIP_VERSION 20
+#define ZIP_VERSION64 45
+#define ZIP_UTF8 0x0800
+#define ZIP_MAX16 0xffffUL
+#define ZIP_MAX32 0xffffffffUL
+
+static const char *const formats[] = {"zip", "dir", "tar"};
+static const char *const suffixes[] = {".cbz", "", ".tar"};
+static const char zeros[TAR_BLOCK];
+
+static int format;
+static FILE *stream;
+static buffer_t central;
+static unsigned long offset, count, stamp;
+static time_t now;
+
+static int emit(void *file, const char *ptr, size_t size)
+{
+	return fwrite(ptr, 1, size, file) == size ? OK : ERROR;
+}
+
+static int put(buffer_t *buf, unsigned long value, size_t size)
+{
+	char bytes[8];
+	size_t i;
+	for (i = 0; i < size; ++i, value >>= 8)
+		bytes[i] = (char)(value & 0xff);
+	return buffer_write(buf, bytes, size) == size ? OK : ERROR;
+}
+
+static unsigned long dos_time(time_t t)
+{
+	struct tm *tm = localtime(&t);
+	if (!tm || tm->tm_year < 80)
+		return 0x00210000UL;
+	return (unsigned long)(tm->tm_year - 80) << 25 | (unsigned long)(tm->tm_mon + 1) << 21 |
+	       (unsigned long)tm->tm_mday << 16 | (unsigned long)tm->tm_hour << 11 |
+	       (unsigned long)tm->tm_min << 5 | (unsigned long)(tm->tm_sec / 2);
+}
+
+static int zip_add(const char *name, const char *key, spool_t *spool, spool_t *packed)
+{
+	int result = ERROR, wide = offset >= ZIP_MAX32;
+	size_t n = strlen(name), k = strlen(key);
+	unsigned long version = wide ? ZIP_VERSION64 : ZIP_VERSION;
+	unsigned long method = packed ? Z_DEFLATED : 0;
+	unsigned long usize = (unsigned long)spool->size;
+	unsigned long csize = packed ? (unsigned long)packed->size : usize;
+	buffer_t local = buffer_make(0);
+	if (n > ZIP_MAX16 || k > ZIP_MAX16)
+		goto cleanup;
+	if (put(&local, ZIP_LOCAL, 4) || put(&local, ZIP_VERSION, 2) ||
+	    put(&local, ZIP_UTF8, 2) || put(&local, method, 2) ||
+	    put(&local, stamp, 4) || put(&local, spool->crc, 4) ||
+	    put(&local, csize, 4) || put(&local, usize, 4) ||
+	    put(&local, n, 2) || put(&local, 0, 2) ||
+	    buffer_write(&local, name, n) != n ||
+	    emit(stream, local.data, local.n) ||
+	    spool_copy(packed ? packed : spool, emit, stream))
+		goto cleanup;
+	if (put(&central, ZIP_CENTRAL, 4) || put(&central, version, 2) ||
+	    put(&central, version, 2) || put(&central, ZIP_UTF8, 2) ||
+	    put(&central, method, 2) || put(&central, stamp, 4) ||
+	    put(&central, spool->crc, 4) || put(&central, csize, 4) ||
+	    put(&central, usize, 4) || put(&central, n, 2) ||
+	    put(&central, wide ? 12 : 0, 2) || put(&central, k, 2) ||
+	    put(&central, 0, 2) || put(&central, 0, 2) || put(&central, 0, 4) ||
+	    put(&central, wide ? ZIP_MAX32 : offset, 4) ||
+	    buffer_write(&central, name, n) != n ||
+	    (wide && (put(&central, 1, 2) || put(&central, 8, 2) || put(&central, offset, 8))) ||
+	    buffer_write(&central, key, k) != k)
+		goto cleanup;
+	offset += (unsigned long)local.n + csize;
+	++count;
+	result = OK;
+cleanup:
+	buffer_free(&local);
+	return result;
+}
+
+static int zip_finish(void)
+{
+	int result = ERROR;
+	int wide = count >= ZIP_MAX16 || central.n >= ZIP_MAX32 || offset >= ZIP_MAX32;
+	buffer_t end = buffer_make(0);
+	if (wide && (put(&end, ZIP_END64, 4) || put(&end, 44, 8) ||
+	    put(&end, ZIP_VERSION64, 2) || put(&end, ZIP_VERSION64, 2) ||
+	    put(&end, 0, 4) || put(&end, 0, 4) || put(&end, count, 8) ||
+	    put(&end, count, 8) || put(&end, (unsigned long)central.n, 8) ||
+	    put(&end, offset, 8) || put(&end, ZIP_LOCATOR, 4) || put(&end, 0, 4) ||
+	    put(&end, offset + (unsigned long)central.n, 8) || put(&end, 1, 4)))
+		goto cleanup;
+	if (put(&end, ZIP_END, 4) || put(&end, 0, 2) || put(&end, 0, 2) ||
+	    put(&end, wide ? ZIP_MAX16 : count, 2) || put(&end, wide ? ZIP_MAX16 : count, 2) ||
+	    put(&end, wide ? ZIP_MAX32 : (unsigned long)central.n, 4) ||
+	    put(&end, wide ? ZIP_MAX32 : offset, 4) || put(&end, 0, 2) ||
+	    emit(stream, central.data, central.n) ||
+	    emit(stream, end.data, end.n))
+		goto cleanup;
+	result = OK;
+cleanup:
+	buffer_free(&end);
+	return result;
+}
+
+static void octal(char *field, size_t size, unsigned long value)
+{
+	field[--size] = '\0';
+	while (size--) {
+		field[size] = (char)('0' + (value & 7));
+		value >>= 3;
+	}
+}
+
+static size_t split_name(const char *name, size_t n)
+{
+	size_t i;
+	for (i = 0; i < n && i <= TAR_PREFIX; ++i)
+		if (name[i] == '/' && n - i - 1 <= TAR_NAME)
+			return i;
+	return 0;
+}
+
+static int tar_header(FILE *file, const char *name, size_t size, char type)
+{
+	char block[TAR_BLOCK];
+	unsigned long sum = 0;
+	size_t i, n = strlen(name), split = n > TAR_NAME ? split_name(name, n) : 0;
+	memset(block, 0, sizeof(block));
+	if (split) {
+		memcpy(block + 345, name, split);
+		memcpy(block, name + split + 1, n - split - 1);
+	} else {
+		memcpy(block, name, n < TAR_NAME ? n : TAR_NAME);
+	}
+	octal(block + 100, 8, 0644);
+	octal(block + 108, 8, 0);
+	octal(block + 116, 8, 0);
+	octal(block + 124, 12, (unsigned long)size);
+	octal(block + 136, 12, (unsigned long)now);
+	memset(block + 148, ' ', 8);
+	block[156] = type;
+	memcpy(block + 257, "ustar", 6);
+	memcpy(block + 263, "00", 2);
+	for (i = 0; i < sizeof(block); ++i)
+		sum += (unsigned char)block[i];
+	octal(block + 148, 7, sum);
+	return emit(file, block, sizeof(block));
+}
+
+static int tar_pad(FILE *file, size_t size)
+{
+	return emit(file, zeros, (TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK);
+}
+
+static int tar_path(FILE *file, const char *name)
+{
+	int result = ERROR;
+	size_t n = strlen(name), size = n + sizeof(" path=\n") - 1, total, digits, i;
+	buffer_t record = buffer_make(0);
+	if (n <= TAR_NAME || split_name(name, n))
+		return OK;
+	for (digits = 1;; ++digits) {
+		total = size + digits;
+		for (i = 1; total >= 10; total /= 10, ++i);
+		if (i == digits)
+			break;
+	}
+	if (buffer_append_ulong(&record, size + digits, 0) ||
+	    buffer_append(&record, " path=") ||
+	    buffer_append(&record, name) ||
+	    buffer_append(&record, "\n") ||
+	    tar_header(file, "././@PaxHeader", record.n, 'x') ||
+	    emit(file, record.data, record.n) ||
+	    tar_pad(file, record.n))
+		goto cleanup;
+	result = OK;
+cleanup:
+	buffer_free(&record);
+	return result;
+}
+
+static int tar_add(FILE *file, const char *name, spool_t *spool)
+{
+	if (tar_path(file, name) ||
+	    tar_header(file, name, spool->size, '0') ||
+	    spool_copy(spool, emit, file) ||
+	    tar_pad(file, spool->size))
+		return ERROR;
+	return OK;
+}
+
+static int tar_finish(FILE *file)
+{
+	return emit(file, zeros, sizeof(zeros)) || emit(file, zeros, sizeof(zeros)) ? ERROR : OK;
+}
+
+static int remove_dir(const char *path)
+{
+	DIR *dir;
+	struct dirent *entry;
+	buffer_t file = buffer_make(0);
+	if (!(dir = opendir(path)))
+		return errno == ENOENT ? OK : ERROR;
+	while ((entry = readdir(dir))) {
+		if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
+			continue;
+		buffer_rewind(&file, 0);
+		if (!buffer_append(&file, path) && !buffer_append(&file, "/") &&
+		    !buffer_append(&file, entry->d_name))
+			remove(file.data);
+	}
+	closedir(dir);
+	buffer_free(&file);
+	return rmdir(path) ? ERROR : OK;
+}
+
+static int dir_add(output_t *output, const char *name, spool_t *spool)
+{
+	int result = ERROR;
+	FILE *file;
+	buffer_t path = buffer_make(0);
+	if (buffer_append(&path, output->part) ||
+	    buffer_append(&path, "/") ||
+	    buffer_append(&path, name))
+		goto cleanup;
+	remove(path.data);
+	if (spool->source && !link(spool->source, path.data)) {
+		result = OK;
+		goto cleanup;
+	}
+	if (!(file = fopen(path.data, "wb")))
+		goto cleanup;
+	result = spool_copy(spool, emit, file);
+	if (fclose(file))
+		result = ERROR;
+cleanup:
+	buffer_free(&path);
+	return result;
+}
+
+static int dir_close(output_t *output)
+{
+	if (!rename(output->part, output->path))
+		return OK;
+	if ((errno != EEXIST && errno != ENOTEMPTY) || remove_dir(output->path))
+		return ERROR;
+	return rename(output->part, output->path) ? ERROR : OK;
+}
+
+int output_init(const char *name, const char *path)
+{
+	int fd;
+	for (format = 0; name && (size_t)format < SIZEOF(formats); ++format)
+		if (!strcmp(name, formats[format]))
+			break;
+	if ((size_t)format == SIZEOF(formats)) {
+		format = OUTPUT_ZIP;
+		return ERROR;
+	}
+	if (!name)
+		format = OUTPUT_ZIP;
+	now = time(NULL);
+	stamp = dos_time(now);
+	central = buffer_make(0);
+	if (!path)
+		return OK;
+	if (format == OUTPUT_DIR)
+		return ERROR;
+	if (strcmp(path, "-"))
+		return (stream = fopen(path, "wb")) ? OK : ERROR;
+	fflush(stdout);
+	if ((fd = dup(STDOUT_FILENO)) < 0)
+		return ERROR;
+	if (!(stream = fdopen(fd, "wb"))) {
+		close(fd);
+		return ERROR;
+	}
+	return dup2(STDERR_FILENO, STDOUT_FILENO) < 0 ? ERROR : OK;
+}
+
+int output_finish(void)
+{
+	if (!stream)
+		return OK;
+	if (format == OUTPUT_ZIP ? zip_finish() : tar_finish(stream))
+		return ERROR;
+	return fflush(stream) ? ERROR : OK;
+}
+
+void output_free(void)
+{
+	if (stream)
+		fclose(stream);
+	buffer_free(&central);
+	stream = NULL;
+	offset = count = 0;
+}
+
+int output_format(void)
+{
+	return format;
+}
+
+int output_streaming(void)
+{
+	return !!stream;
+}
+
+int output_resumable(void)
+{
+	return format == OUTPUT_ZIP && !stream;
+}
+
+const char *output_suffix(void)
+{
+	return stream ? "" : suffixes[format];
+}
+
+static int entry_name(buffer_t *buf, const output_t *output, const char *name)
+{
+	if (stream && (buffer_append(buf, output->path) || buffer_append(buf, "/")))
+		return ERROR;
+	return buffer_append(buf, name);
+}
+
+int output_open(output_t *output, const char *path, int mode)
+{
+	memset(output, 0, sizeof(*output));
+	if (output_resumable())
+		return archive_open(&output->archive, path, mode);
+	if (!(output->path = strdup(path)))
+		return ERROR;
+	if (stream)
+		return OK;
+	if (!(output->part = malloc(strlen(path) + sizeof(".part"))))
+		goto error;
+	strcat(strcpy(output->part, path), ".part");
+	if (format == OUTPUT_DIR ? remove_dir(output->part) || mkdir(output->part, 0750) :
+	    !(output->file = fopen(output->part, "wb")))
+		goto error;
+	return OK;
+error:
+	output_abort(output);
+	return ERROR;
+}
+
+int output_add(output_t *output, const char *name, const char *key, spool_t *spool, spool_t *packed)
+{
+	int result = ERROR;
+	buffer_t entry = buffer_make(0);
+	if (output_resumable())
+		return archive_add(&output->archive, name, key, spool, packed);
+	if (format == OUTPUT_DIR)
+		return dir_add(output, name, spool);
+	if (entry_name(&entry, output, name))
+		goto cleanup;
+	if (format == OUTPUT_ZIP)
+		result = zip_add(entry.data, key, spool, packed);
+	else
+		result = tar_add(stream ? stream : output->file, entry.data, spool);
+cleanup:
+	buffer_free(&entry);
+	return result;
+}
+
+int output_copy(output_t *output, const char *name, const char *key, const archive_entry_t *entry)
+{
+	if (!output_resumable())
+		return ERROR;
+	return archive_copy(&output->archive, name, key, entry);
+}
+
+int output_close(output_t *output)
+{
+	int result = ERROR;
+	FILE *file = output->file;
+	if (output_resumable())
+		return archive_close(&output->archive);
+	output->file = NULL;
+	if (file && (tar_finish(file) | fclose(file)))
+		goto cleanup;
+	if (output->part && (format == OUTPUT_DIR ? dir_close(output) : rename(output->part, output->path)))
+		goto cleanup;
+	free(output->part);
+	output->part = NULL;
+	result = OK;
+cleanup:
+	output_abort(output);
+	return result;
+}
+
+void output_abort(output_t *output)
+{
+	if (output_resumable()) {
+		archive_abort(&output->archive);
+		return;
+	}
+	if (output->file)
+		fclose(output->file);
+	if (output->part) {
+		if (format == OUTPUT_DIR)
+			remove_dir(output->part);
+		else
+			remove(output->part);
+	}
+	free(output->path);
+	free(output->part);
+	memset(output, 0, sizeof(*output));
+}
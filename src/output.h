@@ -0,0 +1,32 @@
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <stdio.h>
+#include "util.h"
+#include "spool.h"
+#include "archive.h"
+
+#define OUTPUT_ZIP 0
+#define OUTPUT_DIR 1
+#define OUTPUT_TAR 2
+
+typedef struct output {
+	archive_t archive;
+	FILE *file;
+	char *path, *part;
+} output_t;
+
+int output_init(const char *format, const char *stream);
+int output_finish(void);
+void output_free(void);
+int output_format(void);
+int output_streaming(void);
+int output_resumable(void);
+const char *output_suffix(void);
+int output_open(output_t *output, const char *path, int mode);
+int output_add(output_t *output, const char *name, const char *key, spool_t *spool, spool_t *packed);
+int output_copy(output_t *output, const char *name, const char *key, const archive_entry_t *entry);
+int output_close(output_t *output);
+void output_abort(output_t *output);
+
+#endif
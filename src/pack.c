@@ -0,0 +1,260 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <zlib.h>
+#include "util.h"
+#include "http.h"
+#include "spool.h"
+#include "pack.h"
+
+#define PACK_THREADS 16
+#define PACK_MAGIC 12
+#define PACK_CHUNK 16384
+
+typedef struct format {
+	const char *name;
+	const char *magic;
+	size_t offset, size;
+	int level;
+} format_t;
+
+static format_t formats[] = {
+	{"jpeg", "\xff\xd8\xff", 0, 3, 0},
+	{"png", "\x89PNG", 0, 4, 6},
+	{"gif", "GIF8", 0, 4, 6},
+	{"webp", "WEBP", 8, 4, 0},
+	{"other", "", 0, 0, 0}
+};
+
+static pthread_t threads[PACK_THREADS];
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wakeup = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t finished = PTHREAD_COND_INITIALIZER;
+static pack_job_t *queue, *tail;
+static unsigned started, busy;
+static int stopping;
+static int wake[2] = {-1, -1};
+
+static int parse_policy(const char *policy)
+{
+	size_t i, n;
+	char *end;
+	unsigned long level;
+	while (policy && *policy) {
+		for (i = 0, n = 0; i < SIZEOF(formats); ++i) {
+			n = strlen(formats[i].name);
+			if (!strncmp(policy, formats[i].name, n) && policy[n] == '=')
+				break;
+		}
+		if (i < SIZEOF(formats))
+			policy += n + 1;
+		level = strtoul(policy, &end, 10);
+		if (end == policy || level > 9)
+			return ERROR;
+		for (n = 0; n < SIZEOF(formats); ++n)
+			if (i == n || i == SIZEOF(formats))
+				formats[n].level = (int)level;
+		policy = end;
+		if (*policy == ',')
+			++policy;
+		else if (*policy)
+			return ERROR;
+	}
+	return OK;
+}
+
+typedef struct deflater {
+	z_stream stream;
+	spool_t *out;
+} deflater_t;
+
+static int drain(deflater_t *deflater, int flush)
+{
+	char chunk[PACK_CHUNK];
+	z_stream *stream = &deflater->stream;
+	int status;
+	size_t n;
+	do {
+		stream->next_out = (Bytef *)chunk;
+		stream->avail_out = (uInt)sizeof(chunk);
+		status = deflate(stream, flush);
+		n = sizeof(chunk) - stream->avail_out;
+		if (status == Z_STREAM_ERROR || fwrite(chunk, 1, n, deflater->out->file) != n)
+			return ERROR;
+		deflater->out->size += n;
+	} while (!stream->avail_out && status != Z_STREAM_END);
+	return flush != Z_FINISH || status == Z_STREAM_END ? OK : ERROR;
+}
+
+static int feed(void *data, const char *ptr, size_t size)
+{
+	deflater_t *deflater = data;
+	deflater->stream.next_in = (Bytef *)ptr;
+	deflater->stream.avail_in = (uInt)size;
+	return drain(deflater, Z_NO_FLUSH) || deflater->stream.avail_in ? ERROR : OK;
+}
+
+static int squeeze(pack_job_t *job)
+{
+	int result = ERROR;
+	deflater_t deflater;
+	memset(&deflater, 0, sizeof(deflater));
+	deflater.out = &job->out;
+	spool_close(&job->out);
+	if (spool_open(&job->out, NULL, NULL))
+		return ERROR;
+	if (deflateInit2(&deflater.stream, job->level, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+		return ERROR;
+	if (spool_copy(job->spool, feed, &deflater) || drain(&deflater, Z_FINISH))
+		goto cleanup;
+	result = OK;
+cleanup:
+	deflateEnd(&deflater.stream);
+	return result;
+}
+
+static void *work(void *arg)
+{
+	pack_job_t *job;
+	int result;
+	pthread_mutex_lock(&lock);
+	for (;;) {
+		while (!queue && !stopping)
+			pthread_cond_wait(&wakeup, &lock);
+		if (!(job = queue))
+			break;
+		if (!(queue = job->next))
+			tail = NULL;
+		job->state = PACK_RUNNING;
+		pthread_mutex_unlock(&lock);
+		result = squeeze(job);
+		pthread_mutex_lock(&lock);
+		job->result = result;
+		job->state = PACK_DONE;
+		--busy;
+		pthread_cond_broadcast(&finished);
+		while (write(wake[1], "", 1) < 0 && errno == EINTR);
+	}
+	pthread_mutex_unlock(&lock);
+	return NULL;
+}
+
+static void watch(void)
+{
+	http_watch(busy ? wake[0] : -1);
+}
+
+int pack_init(const char *policy, unsigned count)
+{
+	size_t i;
+	int level = 0;
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (parse_policy(policy))
+		return ERROR;
+	for (i = 0; i < SIZEOF(formats); ++i)
+		if (level < formats[i].level)
+			level = formats[i].level;
+	if (!level)
+		return OK;
+	if (pipe(wake) ||
+	    fcntl(wake[0], F_SETFL, O_NONBLOCK) ||
+	    fcntl(wake[1], F_SETFL, O_NONBLOCK))
+		return ERROR;
+	if (cpus > 0 && count > (unsigned long)cpus)
+		count = (unsigned)cpus;
+	if (count > PACK_THREADS)
+		count = PACK_THREADS;
+	for (started = 0; started < count; ++started)
+		if (pthread_create(&threads[started], NULL, work, NULL))
+			break;
+	return started ? OK : ERROR;
+}
+
+void pack_free(void)
+{
+	unsigned i;
+	pthread_mutex_lock(&lock);
+	stopping = 1;
+	pthread_cond_broadcast(&wakeup);
+	pthread_mutex_unlock(&lock);
+	for (i = 0; i < started; ++i)
+		pthread_join(threads[i], NULL);
+	for (i = 0; i < SIZEOF(wake); ++i)
+		if (wake[i] >= 0)
+			close(wake[i]);
+	if (wake[0] >= 0)
+		http_watch(-1);
+	wake[0] = wake[1] = -1;
+	started = 0;
+	stopping = 0;
+}
+
+int pack_level(spool_t *spool)
+{
+	char magic[PACK_MAGIC];
+	size_t i, n;
+	if (!started)
+		return 0;
+	n = spool_peek(spool, magic, sizeof(magic));
+	for (i = 0; i < SIZEOF(formats) - 1; ++i)
+		if (formats[i].offset + formats[i].size <= n &&
+		    !memcmp(magic + formats[i].offset, formats[i].magic, formats[i].size))
+			break;
+	return formats[i].level;
+}
+
+int pack_submit(pack_job_t *job, spool_t *spool, int level)
+{
+	if (!started)
+		return ERROR;
+	job->spool = spool;
+	job->level = level;
+	job->result = ERROR;
+	job->next = NULL;
+	pthread_mutex_lock(&lock);
+	job->state = PACK_QUEUED;
+	if (tail)
+		tail->next = job;
+	else
+		queue = job;
+	tail = job;
+	++busy;
+	pthread_cond_signal(&wakeup);
+	watch();
+	pthread_mutex_unlock(&lock);
+	return OK;
+}
+
+int pack_done(pack_job_t *job)
+{
+	int done;
+	pthread_mutex_lock(&lock);
+	done = job->state == PACK_DONE;
+	if (started)
+		watch();
+	pthread_mutex_unlock(&lock);
+	return done;
+}
+
+void pack_cancel(pack_job_t *job)
+{
+	pack_job_t **link;
+	pthread_mutex_lock(&lock);
+	if (job->state == PACK_QUEUED) {
+		for (link = &queue; *link != job; link = &(*link)->next);
+		*link = job->next;
+		for (tail = queue; tail && tail->next; tail = tail->next);
+		--busy;
+	}
+	while (job->state == PACK_RUNNING)
+		pthread_cond_wait(&finished, &lock);
+	job->state = PACK_IDLE;
+	if (started)
+		watch();
+	pthread_mutex_unlock(&lock);
+	spool_close(&job->out);
+}
@@ -0,0 +1,26 @@
+#ifndef PACK_H
+#define PACK_H
+
+#include "util.h"
+#include "spool.h"
+
+#define PACK_IDLE 0
+#define PACK_QUEUED 1
+#define PACK_RUNNING 2
+#define PACK_DONE 3
+
+typedef struct pack_job {
+	spool_t *spool;
+	spool_t out;
+	int level, state, result;
+	struct pack_job *next;
+} pack_job_t;
+
+int pack_init(const char *policy, unsigned threads);
+void pack_free(void);
+int pack_level(spool_t *spool);
+int pack_submit(pack_job_t *job, spool_t *spool, int level);
+int pack_done(pack_job_t *job);
+void pack_cancel(pack_job_t *job);
+
+#endif
@@ -0,0 +1,47 @@
+#include <math.h>
+#include "util.h"
+#include "rate.h"
+
+rate_t rate_make(double per_second, double burst)
+{
+	rate_t rate = {0};
+	rate.rate = per_second / 1000.0;
+	rate.burst = burst;
+	rate.tokens = burst;
+	rate.stamp = mclock();
+	return rate;
+}
+
+long rate_wait(rate_t *rate, long now)
+{
+	if (now < rate->until)
+		return rate->until - now;
+	if (!rate->rate)
+		return 0;
+	rate->tokens += (double)(now - rate->stamp) * rate->rate;
+	if (rate->tokens > rate->burst)
+		rate->tokens = rate->burst;
+	rate->stamp = now;
+	if (rate->tokens >= 1.0)
+		return 0;
+	return (long)ceil((1.0 - rate->tokens) / rate->rate);
+}
+
+void rate_take(rate_t *rate)
+{
+	rate_spend(rate, 1.0);
+}
+
+void rate_spend(rate_t *rate, double amount)
+{
+	if (rate->rate)
+		rate->tokens -= amount;
+}
+
+void rate_limit(rate_t *rate, long now, long remaining, long delay)
+{
+	if (remaining >= 0 && rate->rate && (double)remaining < rate->tokens)
+		rate->tokens = (double)remaining;
+	if (delay > 0 && remaining <= 0 && now + delay > rate->until)
+		rate->until = now + delay;
+}
@@ -0,0 +1,17 @@
+#ifndef RATE_H
+#define RATE_H
+
+#include "util.h"
+
+typedef struct rate {
+	double tokens, burst, rate;
+	long stamp, until;
+} rate_t;
+
+rate_t rate_make(double per_second, double burst);
+long rate_wait(rate_t *rate, long now);
+void rate_take(rate_t *rate);
+void rate_spend(rate_t *rate, double amount);
+void rate_limit(rate_t *rate, long now, long remaining, long delay);
+
+#endif
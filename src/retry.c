@@ -0,0 +1,57 @@
+#include <stdlib.h>
+#include <time.h>
+#include <curl/curl.h>
+#include "util.h"
+#include "retry.h"
+
+#define BACKOFF_BASE 500
+#define BACKOFF_CAP 30000
+
+void retry_init(void)
+{
+	srand((unsigned)time(NULL));
+}
+
+int retry_check(int code, long status)
+{
+	switch ((CURLcode)code) {
+	case CURLE_OK:
+		break;
+	case CURLE_COULDNT_RESOLVE_HOST:
+	case CURLE_COULDNT_CONNECT:
+	case CURLE_OPERATION_TIMEDOUT:
+	case CURLE_SSL_CONNECT_ERROR:
+	case CURLE_SEND_ERROR:
+	case CURLE_RECV_ERROR:
+	case CURLE_GOT_NOTHING:
+	case CURLE_PARTIAL_FILE:
+	case CURLE_HTTP2:
+	case CURLE_HTTP2_STREAM:
+		return RETRY_AGAIN;
+	default:
+		return RETRY_FATAL;
+	}
+	switch (status) {
+	case 408:
+	case 425:
+	case 429:
+	case 500:
+	case 502:
+	case 503:
+	case 504:
+		return RETRY_AGAIN;
+	default:
+		return RETRY_FATAL;
+	}
+}
+
+long retry_delay(unsigned attempt, long after)
+{
+	long delay = BACKOFF_BASE;
+	while (attempt-- && delay < BACKOFF_CAP)
+		delay *= 2;
+	if (delay > BACKOFF_CAP)
+		delay = BACKOFF_CAP;
+	delay = delay / 2 + rand() % (delay / 2 + 1);
+	return after > delay ? after : delay;
+}
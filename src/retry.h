@@ -0,0 +1,11 @@
+#ifndef RETRY_H
+#define RETRY_H
+
+#define RETRY_FATAL 0
+#define RETRY_AGAIN 1
+
+void retry_init(void);
+int retry_check(int code, long status);
+long retry_delay(unsigned attempt, long after);
+
+#endif
@@ -0,0 +1,184 @@
+#include <string.h>
+#include <ctype.h>
+#include <pthread.h>
+#include "sha256.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SHA256_NI
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+static const unsigned int K[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static const unsigned int H[8] = {
+	0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+#define ROR(X, N) ((X) >> (N) | (X) << (32 - (N)))
+
+static void transform(unsigned int *state, const unsigned char *data, size_t blocks)
+{
+	unsigned int w[64], a, b, c, d, e, f, g, h, t1, t2;
+	size_t i;
+	for (; blocks--; data += 64) {
+		for (i = 0; i < 16; ++i)
+			w[i] = (unsigned int)data[4 * i] << 24 | (unsigned int)data[4 * i + 1] << 16 |
+			       (unsigned int)data[4 * i + 2] << 8 | (unsigned int)data[4 * i + 3];
+		for (; i < 64; ++i)
+			w[i] = w[i - 16] + w[i - 7] +
+			       (ROR(w[i - 15], 7) ^ ROR(w[i - 15], 18) ^ w[i - 15] >> 3) +
+			       (ROR(w[i - 2], 17) ^ ROR(w[i - 2], 19) ^ w[i - 2] >> 10);
+		a = state[0], b = state[1], c = state[2], d = state[3];
+		e = state[4], f = state[5], g = state[6], h = state[7];
+		for (i = 0; i < 64; ++i) {
+			t1 = h + (ROR(e, 6) ^ ROR(e, 11) ^ ROR(e, 25)) + ((e & f) ^ (~e & g)) + K[i] + w[i];
+			t2 = (ROR(a, 2) ^ ROR(a, 13) ^ ROR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+			h = g, g = f, f = e, e = d + t1;
+			d = c, c = b, b = a, a = t1 + t2;
+		}
+		state[0] += a, state[1] += b, state[2] += c, state[3] += d;
+		state[4] += e, state[5] += f, state[6] += g, state[7] += h;
+	}
+}
+
+#ifdef SHA256_NI
+__attribute__((target("sha,sse4.1,ssse3")))
+static void transform_ni(unsigned int *state, const unsigned char *data, size_t blocks)
+{
+	const __m128i mask = _mm_set_epi8(12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+	__m128i state0, state1, msg, tmp, abef, cdgh, m[4];
+	int i;
+	tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)state), 0xb1);
+	state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)(state + 4)), 0x1b);
+	state0 = _mm_alignr_epi8(tmp, state1, 8);
+	state1 = _mm_blend_epi16(state1, tmp, 0xf0);
+	for (; blocks--; data += 64) {
+		abef = state0;
+		cdgh = state1;
+		for (i = 0; i < 16; ++i) {
+			if (i < 4)
+				m[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 16 * i)), mask);
+			msg = _mm_add_epi32(m[i & 3], _mm_loadu_si128((const __m128i *)(K + 4 * i)));
+			state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+			if (i >= 3 && i <= 14) {
+				tmp = _mm_alignr_epi8(m[i & 3], m[(i - 1) & 3], 4);
+				m[(i + 1) & 3] = _mm_add_epi32(m[(i + 1) & 3], tmp);
+				m[(i + 1) & 3] = _mm_sha256msg2_epu32(m[(i + 1) & 3], m[i & 3]);
+			}
+			state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(msg, 0x0e));
+			if (i >= 1 && i <= 12)
+				m[(i - 1) & 3] = _mm_sha256msg1_epu32(m[(i - 1) & 3], m[i & 3]);
+		}
+		state0 = _mm_add_epi32(state0, abef);
+		state1 = _mm_add_epi32(state1, cdgh);
+	}
+	tmp = _mm_shuffle_epi32(state0, 0x1b);
+	state1 = _mm_shuffle_epi32(state1, 0xb1);
+	_mm_storeu_si128((__m128i *)state, _mm_blend_epi16(tmp, state1, 0xf0));
+	_mm_storeu_si128((__m128i *)(state + 4), _mm_alignr_epi8(state1, tmp, 8));
+}
+#endif
+
+static sha256_transform_t chosen = transform;
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+static void pick(void)
+{
+#ifdef SHA256_NI
+	unsigned a, b, c, d;
+	if (__get_cpuid(1, &a, &b, &c, &d) && (c & bit_SSSE3) && (c & bit_SSE4_1) &&
+	    __get_cpuid_count(7, 0, &a, &b, &c, &d) && (b & bit_SHA))
+		chosen = transform_ni;
+#endif
+}
+
+void sha256_init(sha256_t *sha)
+{
+	pthread_once(&once, pick);
+	sha->transform = chosen;
+	memcpy(sha->state, H, sizeof(H));
+	sha->total = 0;
+	sha->n = 0;
+}
+
+void sha256_update(sha256_t *sha, const void *data, size_t size)
+{
+	const unsigned char *ptr = data;
+	size_t n;
+	sha->total += (unsigned long)size;
+	if (sha->n) {
+		n = sizeof(sha->block) - sha->n < size ? sizeof(sha->block) - sha->n : size;
+		memcpy(sha->block + sha->n, ptr, n);
+		sha->n += n;
+		ptr += n;
+		size -= n;
+		if (sha->n < sizeof(sha->block))
+			return;
+		sha->transform(sha->state, sha->block, 1);
+		sha->n = 0;
+	}
+	if (size >= sizeof(sha->block)) {
+		n = size / sizeof(sha->block);
+		sha->transform(sha->state, ptr, n);
+		ptr += n * sizeof(sha->block);
+		size -= n * sizeof(sha->block);
+	}
+	memcpy(sha->block, ptr, size);
+	sha->n = size;
+}
+
+void sha256_final(const sha256_t *sha, unsigned char *digest)
+{
+	sha256_t copy = *sha;
+	unsigned char tail[72];
+	unsigned long bits = sha->total << 3;
+	size_t i, pad = (sha->n < 56 ? 56 : 120) - sha->n;
+	memset(tail, 0, sizeof(tail));
+	tail[0] = 0x80;
+	for (i = 0; i < 8; ++i, bits >>= 8)
+		tail[pad + 7 - i] = (unsigned char)(bits & 0xff);
+	sha256_update(&copy, tail, pad + 8);
+	for (i = 0; i < 32; ++i)
+		digest[i] = (unsigned char)(copy.state[i / 4] >> (24 - 8 * (i % 4)));
+}
+
+const char *sha256_hex(const char *name, size_t size)
+{
+	const char *hash = NULL, *ptr, *end = name + size;
+	size_t i;
+	for (ptr = name; ptr < end && *ptr != '.'; ++ptr)
+		if (*ptr == '-')
+			hash = ptr + 1;
+	if (!hash || (size_t)(ptr - hash) != SHA256_HEX)
+		return NULL;
+	for (i = 0; i < SHA256_HEX; ++i)
+		if (!isxdigit((unsigned char)hash[i]))
+			return NULL;
+	return hash;
+}
+
+int sha256_match(const sha256_t *sha, const char *name, size_t size)
+{
+	static const char digits[] = "0123456789abcdef";
+	unsigned char digest[SHA256_SIZE];
+	const char *hex = sha256_hex(name, size);
+	size_t i;
+	if (!hex)
+		return 1;
+	sha256_final(sha, digest);
+	for (i = 0; i < SHA256_SIZE; ++i)
+		if (tolower((unsigned char)hex[2 * i]) != digits[digest[i] >> 4] ||
+		    tolower((unsigned char)hex[2 * i + 1]) != digits[digest[i] & 15])
+			return 0;
+	return 1;
+}
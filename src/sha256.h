@@ -0,0 +1,25 @@
+#ifndef SHA256_H
+#define SHA256_H
+
+#include "defs.h"
+
+#define SHA256_SIZE 32
+#define SHA256_HEX 64
+
+typedef void (*sha256_transform_t)(unsigned int *state, const unsigned char *data, size_t blocks);
+
+typedef struct sha256 {
+	sha256_transform_t transform;
+	unsigned int state[8];
+	unsigned char block[64];
+	unsigned long total;
+	size_t n;
+} sha256_t;
+
+void sha256_init(sha256_t *sha);
+void sha256_update(sha256_t *sha, const void *data, size_t size);
+void sha256_final(const sha256_t *sha, unsigned char *digest);
+const char *sha256_hex(const char *name, size_t size);
+int sha256_match(const sha256_t *sha, const char *name, size_t size);
+
+#endif
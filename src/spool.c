@@ -0,0 +1,176 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+#include "util.h"
+#include "http.h"
+#include "sha256.h"
+#include "spool.h"
+
+#define SPOOL_CHUNK 16384
+
+static void reset(spool_t *spool, const char *validator)
+{
+	fflush(spool->file);
+	rewind(spool->file);
+	if (ftruncate(fileno(spool->file), 0))
+		clearerr(spool->file);
+	spool->validator[0] = '\0';
+	if (strlen(validator) < sizeof(spool->validator))
+		strcpy(spool->validator, validator);
+	if (spool->key)
+		fprintf(spool->file, "%s %s\n", spool->key, spool->validator);
+	spool->base = ftell(spool->file);
+	spool->crc = crc32(0L, Z_NULL, 0);
+	sha256_init(&spool->sha);
+	spool->size = 0;
+}
+
+static int measure(spool_t *spool)
+{
+	char chunk[SPOOL_CHUNK];
+	size_t n;
+	while ((n = fread(chunk, 1, sizeof(chunk), spool->file))) {
+		spool->crc = crc32(spool->crc, (const Bytef *)chunk, (uInt)n);
+		sha256_update(&spool->sha, chunk, n);
+		spool->size += n;
+	}
+	return ferror(spool->file) ? ERROR : OK;
+}
+
+static int load(spool_t *spool)
+{
+	char *line = NULL, *validator;
+	size_t size = 0, n;
+	ssize_t len = getline(&line, &size, spool->file);
+	n = strlen(spool->key);
+	if (len <= 0 || line[len - 1] != '\n' || strncmp(line, spool->key, n) || line[n] != ' ') {
+		free(line);
+		return ERROR;
+	}
+	line[len - 1] = '\0';
+	validator = line + n + 1;
+	if (strlen(validator) < sizeof(spool->validator))
+		strcpy(spool->validator, validator);
+	free(line);
+	spool->base = ftell(spool->file);
+	return measure(spool);
+}
+
+int spool_open(spool_t *spool, const char *path, const char *key)
+{
+	memset(spool, 0, sizeof(*spool));
+	spool->crc = crc32(0L, Z_NULL, 0);
+	sha256_init(&spool->sha);
+	if (!path)
+		return (spool->file = tmpfile()) ? OK : ERROR;
+	if (!(spool->path = strdup(path)) || !(spool->key = strdup(key)))
+		goto error;
+	if ((spool->file = fopen(path, "r+b")) && !load(spool))
+		return fseek(spool->file, 0L, SEEK_END) ? ERROR : OK;
+	if (!spool->file && !(spool->file = fopen(path, "w+b")))
+		goto error;
+	reset(spool, "");
+	return OK;
+error:
+	spool_close(spool);
+	return ERROR;
+}
+
+int spool_load(spool_t *spool, const char *path)
+{
+	memset(spool, 0, sizeof(*spool));
+	spool->crc = crc32(0L, Z_NULL, 0);
+	sha256_init(&spool->sha);
+	if (!(spool->source = strdup(path)) || !(spool->file = fopen(path, "rb")))
+		goto error;
+	if (!measure(spool))
+		return OK;
+error:
+	spool_close(spool);
+	return ERROR;
+}
+
+void spool_close(spool_t *spool)
+{
+	if (spool->file) {
+		fclose(spool->file);
+		spool->file = NULL;
+		if (spool->path && !spool->size)
+			remove(spool->path);
+	}
+	free(spool->path);
+	free(spool->key);
+	free(spool->source);
+	spool->path = NULL;
+	spool->key = NULL;
+	spool->source = NULL;
+}
+
+void spool_remove(spool_t *spool)
+{
+	spool->size = 0;
+	spool_close(spool);
+}
+
+void spool_rewind(spool_t *spool)
+{
+	reset(spool, "");
+}
+
+static size_t sink_write(void *data, const char *ptr, size_t size)
+{
+	spool_t *spool = data;
+	size = fwrite(ptr, 1, size, spool->file);
+	spool->crc = crc32(spool->crc, (const Bytef *)ptr, (uInt)size);
+	sha256_update(&spool->sha, ptr, size);
+	spool->size += size;
+	return size;
+}
+
+static void sink_rewind(void *data)
+{
+	spool_rewind(data);
+}
+
+static void sink_validate(void *data, const char *validator)
+{
+	reset(data, validator);
+}
+
+http_sink_t spool_sink(spool_t *spool)
+{
+	http_sink_t sink;
+	sink.write = sink_write;
+	sink.rewind = sink_rewind;
+	sink.validate = sink_validate;
+	sink.data = spool;
+	return sink;
+}
+
+size_t spool_peek(spool_t *spool, char *ptr, size_t size)
+{
+	if (size > spool->size)
+		size = spool->size;
+	if (fflush(spool->file) || fseek(spool->file, spool->base, SEEK_SET))
+		return 0;
+	size = fread(ptr, 1, size, spool->file);
+	return fseek(spool->file, 0L, SEEK_END) ? 0 : size;
+}
+
+int spool_copy(spool_t *spool, spool_write_t write, void *data)
+{
+	char chunk[SPOOL_CHUNK];
+	size_t size, left = spool->size;
+	if (fflush(spool->file) || fseek(spool->file, spool->base, SEEK_SET))
+		return ERROR;
+	while (left) {
+		size = left < sizeof(chunk) ? left : sizeof(chunk);
+		if (fread(chunk, 1, size, spool->file) != size ||
+		    write(data, chunk, size))
+			return ERROR;
+		left -= size;
+	}
+	return fseek(spool->file, 0L, SEEK_END) ? ERROR : OK;
+}
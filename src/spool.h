@@ -0,0 +1,30 @@
+#ifndef SPOOL_H
+#define SPOOL_H
+
+#include <stdio.h>
+#include "util.h"
+#include "http.h"
+#include "sha256.h"
+
+typedef struct spool {
+	FILE *file;
+	char *path, *key, *source;
+	char validator[128];
+	long base;
+	unsigned long crc;
+	size_t size;
+	sha256_t sha;
+} spool_t;
+
+typedef int (*spool_write_t)(void *data, const char *ptr, size_t size);
+
+int spool_open(spool_t *spool, const char *path, const char *key);
+int spool_load(spool_t *spool, const char *path);
+void spool_close(spool_t *spool);
+void spool_remove(spool_t *spool);
+void spool_rewind(spool_t *spool);
+http_sink_t spool_sink(spool_t *spool);
+size_t spool_peek(spool_t *spool, char *ptr, size_t size);
+int spool_copy(spool_t *spool, spool_write_t write, void *data);
+
+#endif
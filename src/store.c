@@ -0,0 +1,177 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "util.h"
+#include "spool.h"
+#include "sha256.h"
+#include "store.h"
+
+#define STORE_CHUNK 16384
+
+static buffer_t root;
+
+int store_init(const char *dir)
+{
+	root = buffer_make(0);
+	if (!dir)
+		return OK;
+	if (buffer_append(&root, dir) || make_dirs(root.data)) {
+		buffer_free(&root);
+		return ERROR;
+	}
+	return OK;
+}
+
+void store_free(void)
+{
+	buffer_free(&root);
+}
+
+static int page_path(buffer_t *path, const char *file, size_t size)
+{
+	const char *hash = sha256_hex(file, size);
+	if (!root.data || !hash)
+		return ERROR;
+	if (buffer_strcpy(path, root.data, root.n) ||
+	    buffer_append(path, "/") ||
+	    buffer_strcpy(path, hash, 2) ||
+	    buffer_append(path, "/") ||
+	    buffer_strcpy(path, hash, SHA256_HEX))
+		return ERROR;
+	return OK;
+}
+
+static int manifest_path(buffer_t *path, const char *chapter, unsigned version)
+{
+	if (!root.data ||
+	    buffer_strcpy(path, root.data, root.n) ||
+	    buffer_append(path, "/at-home/") ||
+	    buffer_append(path, chapter) ||
+	    buffer_append(path, ".") ||
+	    buffer_append_ulong(path, version, 0))
+		return ERROR;
+	return OK;
+}
+
+typedef int (*store_write_t)(FILE *file, void *data);
+
+static int write_file(void *file, const char *ptr, size_t size)
+{
+	return fwrite(ptr, 1, size, file) == size ? OK : ERROR;
+}
+
+static int write_spool(FILE *file, void *spool)
+{
+	return spool_copy(spool, write_file, file);
+}
+
+static int write_buffer(FILE *file, void *buf)
+{
+	const buffer_t *buffer = buf;
+	return write_file(file, buffer->data, buffer->n);
+}
+
+static int publish(const char *path, store_write_t write, void *data)
+{
+	int result = ERROR;
+	char *slash;
+	FILE *file = NULL;
+	buffer_t tmp = buffer_make(0);
+	if (buffer_append(&tmp, path) ||
+	    !(slash = strrchr(tmp.data, '/')))
+		goto cleanup;
+	*slash = '\0';
+	if (make_dirs(tmp.data))
+		goto cleanup;
+	*slash = '/';
+	if (buffer_append(&tmp, ".") ||
+	    buffer_append_ulong(&tmp, (unsigned long)getpid(), 0) ||
+	    buffer_append(&tmp, ".tmp") ||
+	    !(file = fopen(tmp.data, "wb")))
+		goto cleanup;
+	if (write(file, data)) {
+		fclose(file);
+		remove(tmp.data);
+		goto cleanup;
+	}
+	if (fclose(file) || rename(tmp.data, path)) {
+		remove(tmp.data);
+		goto cleanup;
+	}
+	result = OK;
+cleanup:
+	buffer_free(&tmp);
+	return result;
+}
+
+int store_has(const char *file, size_t size)
+{
+	int result;
+	buffer_t path = buffer_make(0);
+	result = !page_path(&path, file, size) && !access(path.data, F_OK);
+	buffer_free(&path);
+	return result;
+}
+
+int store_open(spool_t *spool, const char *file, size_t size)
+{
+	int result = ERROR;
+	buffer_t path = buffer_make(0);
+	if (!page_path(&path, file, size) && !(result = spool_load(spool, path.data)) &&
+	    !sha256_match(&spool->sha, file, size)) {
+		spool_close(spool);
+		remove(path.data);
+		result = ERROR;
+	}
+	buffer_free(&path);
+	return result;
+}
+
+int store_put(spool_t *spool, const char *file, size_t size)
+{
+	int result = OK;
+	buffer_t path = buffer_make(0);
+	if (!page_path(&path, file, size)) {
+		if (access(path.data, F_OK))
+			result = publish(path.data, write_spool, spool);
+		if (!result && !spool->source && !(spool->source = strdup(path.data)))
+			result = ERROR;
+	}
+	buffer_free(&path);
+	return result;
+}
+
+int store_load(const char *chapter, unsigned version, buffer_t *manifest)
+{
+	int result = ERROR;
+	char chunk[STORE_CHUNK];
+	size_t n;
+	FILE *file = NULL;
+	buffer_t path = buffer_make(0);
+	if (manifest_path(&path, chapter, version) ||
+	    !(file = fopen(path.data, "rb")))
+		goto cleanup;
+	buffer_rewind(manifest, 0);
+	while ((n = fread(chunk, 1, sizeof(chunk), file)))
+		if (buffer_write(manifest, chunk, n) != n)
+			goto cleanup;
+	if (ferror(file) || !manifest->n)
+		goto cleanup;
+	result = OK;
+cleanup:
+	if (file)
+		fclose(file);
+	buffer_free(&path);
+	return result;
+}
+
+int store_save(const char *chapter, unsigned version, const buffer_t *manifest)
+{
+	int result = OK;
+	buffer_t path = buffer_make(0);
+	if (!manifest_path(&path, chapter, version))
+		result = publish(path.data, write_buffer, (void *)manifest);
+	buffer_free(&path);
+	return result;
+}
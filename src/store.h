@@ -0,0 +1,15 @@
+#ifndef STORE_H
+#define STORE_H
+
+#include "util.h"
+#include "spool.h"
+
+int store_init(const char *dir);
+void store_free(void);
+int store_has(const char *file, size_t size);
+int store_open(spool_t *spool, const char *file, size_t size);
+int store_put(spool_t *spool, const char *file, size_t size);
+int store_load(const char *chapter, unsigned version, buffer_t *manifest);
+int store_save(const char *chapter, unsigned version, const buffer_t *manifest);
+
+#endif
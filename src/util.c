@@ -3,6 +3,8 @@
 #include <stdio.h>
 #include <math.h>
 #include <time.h>
+#include <errno.h>
+#include <sys/stat.h>
 #include "util.h"
 
 void msleep(long ms)
@@ -13,6 +15,13 @@ void msleep(long ms)
 	while (nanosleep(&ts, &ts));
 }
 
+long mclock(void)
+{
+	struct timespec ts = {0};
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
 buffer_t buffer_make(size_t size)
 {
 	buffer_t buf = {0};
@@ -112,6 +121,24 @@ int buffer_append_ulong(buffer_t *buf, unsigned long num, int iwidth)
 	return OK;
 }
 
+int make_dirs(char *path)
+{
+	char *ptr;
+	for (ptr = path + 1; *ptr; ++ptr) {
+		if (*ptr != '/')
+			continue;
+		*ptr = '\0';
+		if (mkdir(path, 0750) && errno != EEXIST) {
+			*ptr = '/';
+			return ERROR;
+		}
+		*ptr = '/';
+	}
+	if (mkdir(path, 0750) && errno != EEXIST)
+		return ERROR;
+	return OK;
+}
+
 int try_realloc(void *pptr, size_t *out_n, size_t new_n, size_t size)
 {
 	void **ptr = pptr, *new_ptr;
@@ -4,6 +4,8 @@
 #include "defs.h"
 
 void msleep(long ms);
+long mclock(void);
+int make_dirs(char *path);
 int try_realloc(void *pptr, size_t *out_n, size_t new_n, size_t size);
 #define TRY_REALLOC(B, S, N) try_realloc((B), (S), (N), sizeof(**(B)))
 
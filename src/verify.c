@@ -0,0 +1,60 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "util.h"
+#include "archive.h"
+#include "verify.h"
+
+#define VERIFY_THREADS 16
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static verify_jobs_t *queue;
+static size_t next;
+
+static void report(const verify_job_t *job)
+{
+	pthread_mutex_lock(&lock);
+	if (job->result)
+		printf("Broken:   %s\n", job->path);
+	else if (job->damaged)
+		printf("Damaged:  %s (%lu/%lu pages)\n", job->path, job->damaged, job->pages);
+	fflush(stdout);
+	pthread_mutex_unlock(&lock);
+}
+
+static void *work(void *arg)
+{
+	verify_job_t *job;
+	for (;;) {
+		pthread_mutex_lock(&lock);
+		job = next < queue->n ? &queue->data[next++] : NULL;
+		pthread_mutex_unlock(&lock);
+		if (!job)
+			break;
+		job->result = archive_verify(job->path, &job->pages, &job->damaged);
+		report(job);
+	}
+	return NULL;
+}
+
+int verify_run(verify_jobs_t *jobs)
+{
+	pthread_t threads[VERIFY_THREADS];
+	unsigned i, count = VERIFY_THREADS, started;
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cpus > 0 && count > (unsigned long)cpus)
+		count = (unsigned)cpus;
+	if (count > jobs->n)
+		count = (unsigned)jobs->n;
+	queue = jobs;
+	next = 0;
+	for (started = 0; started < count; ++started)
+		if (pthread_create(&threads[started], NULL, work, NULL))
+			break;
+	if (!started)
+		work(NULL);
+	for (i = 0; i < started; ++i)
+		pthread_join(threads[i], NULL);
+	queue = NULL;
+	return OK;
+}
@@ -0,0 +1,25 @@
+#ifndef VERIFY_H
+#define VERIFY_H
+
+#include <stdlib.h>
+#include "util.h"
+
+typedef struct verify_job {
+	char *path;
+	size_t pages, damaged;
+	int result;
+} verify_job_t;
+
+static void verify_job_free(verify_job_t *job)
+{
+	free(job->path);
+}
+
+#define VECT_NAME verify_jobs
+#define VECT_ELEM verify_job_t
+#define VECT_FREE verify_job_free
+#include "vect.h"
+
+int verify_run(verify_jobs_t *jobs);
+
+#endif
@@ -0,0 +1,257 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <zlib.h>
+#include "../src/util.h"
+#include "../src/spool.h"
+#include "../src/sha256.h"
+#include "../src/archive.h"
+
+#define PAGES 5
+#define PAGE_SIZE 20000
+
+static char dir[] = "/tmp/mdex-archive-XXXXXX";
+static char path[sizeof(dir) + 16];
+static char keys[PAGES][SHA256_HEX + 16];
+static unsigned char packed[PAGES][PAGE_SIZE];
+static size_t packed_size[PAGES];
+
+static void page_data(char *data, size_t page)
+{
+	size_t i;
+	for (i = 0; i < PAGE_SIZE; ++i)
+		data[i] = (char)((i * (page + 3)) >> 4 & 0xff);
+}
+
+static int pack(char *data, size_t page)
+{
+	int status;
+	z_stream stream;
+	memset(&stream, 0, sizeof(stream));
+	if (deflateInit2(&stream, 6, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+		return ERROR;
+	stream.next_in = (Bytef *)data;
+	stream.avail_in = PAGE_SIZE;
+	stream.next_out = packed[page];
+	stream.avail_out = PAGE_SIZE;
+	status = deflate(&stream, Z_FINISH);
+	packed_size[page] = PAGE_SIZE - stream.avail_out;
+	deflateEnd(&stream);
+	return status == Z_STREAM_END ? OK : ERROR;
+}
+
+static int make_keys(void)
+{
+	static const char digits[] = "0123456789abcdef";
+	static char data[PAGE_SIZE];
+	unsigned char digest[SHA256_SIZE];
+	size_t page, i;
+	sha256_t sha;
+	for (page = 0; page < PAGES; ++page) {
+		page_data(data, page);
+		sha256_init(&sha);
+		sha256_update(&sha, data, sizeof(data));
+		sha256_final(&sha, digest);
+		if (pack(data, page))
+			return ERROR;
+		sprintf(keys[page], "k%lu-", (unsigned long)page);
+		for (i = 0; i < SHA256_SIZE; ++i)
+			sprintf(keys[page] + strlen(keys[page]), "%c%c", digits[digest[i] >> 4], digits[digest[i] & 15]);
+		strcat(keys[page], ".png");
+	}
+	return OK;
+}
+
+static void page_name(char *name, size_t number)
+{
+	sprintf(name, "001-%03lu.png", (unsigned long)number);
+}
+
+static int add_page(archive_t *archive, size_t page, size_t number)
+{
+	static char data[PAGE_SIZE];
+	char name[32];
+	int result = ERROR;
+	spool_t spool, out;
+	http_sink_t sink;
+	page_data(data, page);
+	page_name(name, number);
+	if (spool_open(&spool, NULL, NULL))
+		return ERROR;
+	if (spool_open(&out, NULL, NULL)) {
+		spool_close(&spool);
+		return ERROR;
+	}
+	sink = spool_sink(&spool);
+	if (sink.write(sink.data, data, sizeof(data)) != sizeof(data))
+		goto cleanup;
+	sink = spool_sink(&out);
+	if (sink.write(sink.data, (const char *)packed[page], packed_size[page]) != packed_size[page] ||
+	    archive_add(archive, name, keys[page], &spool, page % 2 ? NULL : &out))
+		goto cleanup;
+	result = OK;
+cleanup:
+	spool_close(&out);
+	spool_close(&spool);
+	return result;
+}
+
+static const archive_entry_t *find_key(const archive_entries_t *entries, size_t page)
+{
+	size_t i;
+	for (i = 0; i < entries->n; ++i)
+		if (!strcmp(entries->data[i].key, keys[page]))
+			return &entries->data[i];
+	return NULL;
+}
+
+static int copy_pages(archive_t *archive, const archive_entries_t *entries, size_t first)
+{
+	char name[32];
+	size_t page;
+	const archive_entry_t *entry;
+	for (page = 0; page < PAGES; ++page) {
+		page_name(name, page + first);
+		if ((entry = find_key(entries, page)) && archive_copy(archive, name, keys[page], entry))
+			return ERROR;
+	}
+	return OK;
+}
+
+static int crash(int stage, const archive_entries_t *entries)
+{
+	archive_t archive;
+	size_t page;
+	int status;
+	pid_t pid;
+	fflush(NULL);
+	if ((pid = fork()) < 0)
+		return ERROR;
+	if (!pid) {
+		if (stage == 1) {
+			if (archive_open(&archive, path, ARCHIVE_CREATE))
+				_exit(1);
+			for (page = 1; page < PAGES; ++page)
+				if (add_page(&archive, page, page))
+					_exit(1);
+		} else if (archive_open(&archive, path, ARCHIVE_RECOVER) ||
+		           copy_pages(&archive, entries, 1)) {
+			_exit(1);
+		}
+		fflush(NULL);
+		_exit(0);
+	}
+	return waitpid(pid, &status, 0) == pid && WIFEXITED(status) && !WEXITSTATUS(status) ? OK : ERROR;
+}
+
+static int check(const archive_entries_t *entries, size_t count, size_t first, const char *what)
+{
+	char name[32];
+	size_t page;
+	const archive_entry_t *entry;
+	if (entries->n != count) {
+		printf("archive: %s: %lu entries, expected %lu\n", what, (unsigned long)entries->n, (unsigned long)count);
+		return ERROR;
+	}
+	for (page = 1; page < PAGES; ++page) {
+		page_name(name, page + first);
+		if (!(entry = find_key(entries, page)) || !entry->valid || strcmp(entry->name, name)) {
+			printf("archive: %s: page %lu is missing or damaged\n", what, (unsigned long)page);
+			return ERROR;
+		}
+	}
+	return OK;
+}
+
+static int recover_twice(void)
+{
+	int result = ERROR;
+	archive_t archive;
+	archive_entries_t entries = archive_entries_make(0);
+	if (crash(1, NULL) || archive_recover(path, &entries) ||
+	    check(&entries, PAGES - 1, 0, "first recovery"))
+		goto cleanup;
+	if (crash(2, &entries))
+		goto cleanup;
+	archive_entries_free(&entries);
+	entries = archive_entries_make(0);
+	if (archive_recover(path, &entries) || check(&entries, PAGES - 1, 1, "second recovery"))
+		goto cleanup;
+	if (archive_open(&archive, path, ARCHIVE_RECOVER) ||
+	    copy_pages(&archive, &entries, 1) || add_page(&archive, 0, 1) ||
+	    archive_close(&archive))
+		goto cleanup;
+	archive_entries_free(&entries);
+	entries = archive_entries_make(0);
+	if (archive_scan(path, &entries) || check(&entries, PAGES, 1, "final archive"))
+		goto cleanup;
+	puts("archive: recovered across two interruptions: OK");
+	result = OK;
+cleanup:
+	archive_entries_free(&entries);
+	return result;
+}
+
+static int damage(size_t page)
+{
+	int result = ERROR;
+	char *data = NULL, *hit;
+	char part[sizeof(path) + 8];
+	long size;
+	FILE *file;
+	sprintf(part, "%s.part", path);
+	if (!(file = fopen(part, "r+b")) || fseek(file, 0L, SEEK_END) || (size = ftell(file)) <= 0 ||
+	    !(data = malloc((size_t)size)) || fseek(file, 0L, SEEK_SET) ||
+	    fread(data, 1, (size_t)size, file) != (size_t)size ||
+	    !(hit = memmem(data, (size_t)size, packed[page], packed_size[page])) ||
+	    fseek(file, (long)(hit - data) + (long)packed_size[page] / 2, SEEK_SET) ||
+	    fputc(hit[packed_size[page] / 2] ^ 0x10, file) == EOF)
+		goto cleanup;
+	result = OK;
+cleanup:
+	free(data);
+	if (file && fclose(file))
+		result = ERROR;
+	return result;
+}
+
+static int reject_damaged(void)
+{
+	int result = ERROR;
+	archive_entries_t entries = archive_entries_make(0);
+	if (crash(1, NULL) || damage(2) || archive_recover(path, &entries))
+		goto cleanup;
+	if (entries.n != 1 || !find_key(&entries, 1)) {
+		printf("archive: damaged deflated page: %lu entries recovered, expected 1\n", (unsigned long)entries.n);
+		goto cleanup;
+	}
+	puts("archive: damaged deflated page rejected: OK");
+	result = OK;
+cleanup:
+	archive_entries_free(&entries);
+	return result;
+}
+
+static void clean(void)
+{
+	char name[sizeof(path) + 8];
+	remove(path);
+	sprintf(name, "%s.part", path);
+	remove(name);
+	sprintf(name, "%s.journal", path);
+	remove(name);
+	rmdir(dir);
+}
+
+int main(void)
+{
+	int result;
+	if (!mkdtemp(dir))
+		return EXIT_FAILURE;
+	sprintf(path, "%s/c.cbz", dir);
+	result = make_keys() || recover_twice() || reject_damaged();
+	clean();
+	return result ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,324 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../src/json.c"
+
+#define DOCUMENTS 3000
+#define MUTATIONS 3
+#define MAX_DEPTH 5
+#define FEED_CHAPTERS 500
+#define BENCH_ROUNDS 7
+#define BENCH_PARSES 300
+
+static const classify_t backends[] = {
+	classify,
+#ifdef JSON_SIMD
+	classify_sse2,
+	classify_avx2,
+#endif
+};
+
+static const char *const names[] = {"scalar", "sse2", "avx2"};
+
+static const char *const pieces[] = {
+	"a", "xyz", " ", "/", "{}[]:,", "\\\"", "\\\\", "\\/", "\\n", "\\t",
+	"\\u00e9", "\\ud83d\\ude00", "\xc3\xa9", "\xe2\x98\x83", "\xf0\x9f\x98\x80"
+};
+
+static const char *const primitives[] = {
+	"true", "false", "null", "0", "-2.5e3", "123456789", "1E-7"
+};
+
+static unsigned long seed = 1;
+
+static unsigned rnd(unsigned n)
+{
+	seed ^= seed << 13 & 0xffffffffUL;
+	seed ^= seed >> 17;
+	seed ^= seed << 5 & 0xffffffffUL;
+	seed &= 0xffffffffUL;
+	return (unsigned)(seed % n);
+}
+
+static int append_space(buffer_t *text)
+{
+	static const char spaces[] = " \t\r\n";
+	unsigned n = rnd(4) ? 0 : rnd(4) ? rnd(3) : rnd(90);
+	while (n--)
+		if (buffer_write(text, spaces + rnd(4), 1) != 1)
+			return ERROR;
+	return OK;
+}
+
+static size_t add_token(json_tokens_t *tokens, unsigned type, size_t start)
+{
+	json_t token;
+	memset(&token, 0, sizeof(token));
+	token.type = type & 0xf;
+	token.start = (unsigned)start;
+	token.skip = 1;
+	return json_tokens_push(tokens, &token) ? NONE : tokens->n - 1;
+}
+
+static size_t gen_string(buffer_t *text, json_tokens_t *tokens, unsigned size)
+{
+	size_t i, n = rnd(8), token;
+	unsigned run;
+	if (buffer_write(text, "\"", 1) != 1 || (token = add_token(tokens, JSON_STRING, text->n)) == NONE)
+		return NONE;
+	for (i = 0; i < n; ++i) {
+		if (!rnd(6)) {
+			for (run = rnd(150); run; --run)
+				if (buffer_write(text, "x", 1) != 1)
+					return NONE;
+		} else if (buffer_append(text, pieces[rnd(SIZEOF(pieces))])) {
+			return NONE;
+		}
+	}
+	tokens->data[token].end = (unsigned)text->n;
+	tokens->data[token].size = size & 0xfffffff;
+	return buffer_write(text, "\"", 1) == 1 ? token : NONE;
+}
+
+static size_t gen_value(buffer_t *text, json_tokens_t *tokens, unsigned depth)
+{
+	unsigned kind = depth < MAX_DEPTH ? rnd(6) : 2 + rnd(4), count, i;
+	size_t token, key = NONE, child;
+	int object = kind == 0;
+	if (kind >= 4) {
+		if ((token = add_token(tokens, JSON_PRIMITIVE, text->n)) == NONE ||
+		    buffer_append(text, primitives[rnd(SIZEOF(primitives))]))
+			return NONE;
+		tokens->data[token].end = (unsigned)text->n;
+		return token;
+	}
+	if (kind >= 2)
+		return gen_string(text, tokens, 0);
+	if ((token = add_token(tokens, object ? JSON_OBJECT : JSON_ARRAY, text->n)) == NONE ||
+	    buffer_write(text, object ? "{" : "[", 1) != 1)
+		return NONE;
+	for (count = rnd(6), i = 0; i < count; ++i) {
+		if ((i && buffer_write(text, ",", 1) != 1) || append_space(text))
+			return NONE;
+		if (object && ((key = gen_string(text, tokens, 1)) == NONE ||
+		    append_space(text) || buffer_write(text, ":", 1) != 1 || append_space(text)))
+			return NONE;
+		if ((child = gen_value(text, tokens, depth + 1)) == NONE || append_space(text))
+			return NONE;
+		if (object)
+			tokens->data[key].skip = 1 + tokens->data[child].skip;
+	}
+	if (buffer_write(text, object ? "}" : "]", 1) != 1)
+		return NONE;
+	tokens->data[token].end = (unsigned)text->n;
+	tokens->data[token].size = count & 0xfffffff;
+	tokens->data[token].skip = (unsigned)(tokens->n - token);
+	return token;
+}
+
+static int gen_document(buffer_t *text, json_tokens_t *tokens)
+{
+	size_t token;
+	do {
+		tokens->n = 0;
+		buffer_rewind(text, 0);
+		if (append_space(text) || (token = gen_value(text, tokens, 0)) == NONE || append_space(text))
+			return ERROR;
+	} while (tokens->data[token].type != JSON_OBJECT && tokens->data[token].type != JSON_ARRAY);
+	return OK;
+}
+
+static void mutate(buffer_t *text)
+{
+	static const char chars[] = "{}[]:,\"\\ a1tn-\1";
+	unsigned i, n = 1 + rnd(3);
+	size_t pos;
+	for (i = 0; i < n && text->n; ++i) {
+		pos = rnd((unsigned)text->n);
+		switch (rnd(3)) {
+		case 0:
+			text->data[pos] = chars[rnd(sizeof(chars) - 1)];
+			break;
+		case 1:
+			if (buffer_write(text, " ", 1) != 1)
+				return;
+			memmove(text->data + pos + 1, text->data + pos, text->n - pos - 1);
+			text->data[pos] = chars[rnd(sizeof(chars) - 1)];
+			break;
+		default:
+			memmove(text->data + pos, text->data + pos + 1, text->n - pos - 1);
+			--text->n;
+		}
+	}
+}
+
+static int same(const json_t *json, const json_tokens_t *got, const json_tokens_t *want)
+{
+	size_t i;
+	const json_t *a, *b;
+	if (!json)
+		return 0;
+	if (got->n != want->n)
+		return 0;
+	for (i = 0; i < got->n; ++i) {
+		a = &got->data[i];
+		b = &want->data[i];
+		if (a->start != b->start || a->end != b->end || a->skip != b->skip ||
+		    a->type != b->type || a->size != b->size)
+			return 0;
+	}
+	return 1;
+}
+
+static const json_t *parse_chunked(json_tokens_t *tokens, const char *data, size_t size, unsigned step)
+{
+	json_parser_t parser;
+	size_t cut = 0;
+	json_start(&parser, tokens);
+	while (cut < size) {
+		cut += 1 + rnd(step);
+		if (cut > size)
+			cut = size;
+		if (json_feed(&parser, data, cut))
+			break;
+	}
+	return json_finish(&parser, data, size);
+}
+
+static int copy_tokens(json_tokens_t *dest, const json_t *json, json_tokens_t *src)
+{
+	size_t i;
+	dest->n = 0;
+	for (i = 0; json && i < src->n; ++i)
+		if (json_tokens_push(dest, &src->data[i]))
+			return ERROR;
+	return OK;
+}
+
+static void dump(const char *what, unsigned long doc, const buffer_t *text)
+{
+	printf("json: %s mismatch on seed %lu:\n%.*s\n", what, doc, (int)text->n, text->data);
+}
+
+static int fuzz(unsigned long start, unsigned documents)
+{
+	int result = ERROR;
+	unsigned doc, i, mutation, backend, count = (unsigned)SIZEOF(backends);
+	unsigned long doc_seed;
+	const json_t *json, *first = NULL;
+	buffer_t text = buffer_make(0);
+	json_tokens_t want = json_tokens_make(0), got = json_tokens_make(0), base = json_tokens_make(0);
+	while (count > 1 && backends[count - 1] != pick())
+		--count;
+	for (doc = 0; doc < documents; ++doc) {
+		doc_seed = start + doc;
+		seed = doc_seed & 0xffffffffUL ? doc_seed & 0xffffffffUL : 1;
+		if (gen_document(&text, &want))
+			goto cleanup;
+		for (mutation = 0; mutation <= MUTATIONS; ++mutation) {
+			if (mutation)
+				mutate(&text);
+			for (backend = 0; backend < count; ++backend) {
+				chosen = backends[backend];
+				json = json_parse(&got, text.data, text.n);
+				if (!mutation && !same(json, &got, &want)) {
+					dump(names[backend], doc_seed, &text);
+					goto cleanup;
+				}
+				if (!backend) {
+					first = json;
+					if (copy_tokens(&base, json, &got))
+						goto cleanup;
+				} else if (!json != !first || (json && !same(json, &got, &base))) {
+					dump(names[backend], doc_seed, &text);
+					goto cleanup;
+				}
+				for (i = 0; i < 2; ++i) {
+					json = parse_chunked(&got, text.data, text.n, i ? 200 : 7);
+					if (!json != !first || (json && !same(json, &got, &base))) {
+						dump("chunked", doc_seed, &text);
+						goto cleanup;
+					}
+				}
+			}
+		}
+	}
+	printf("json: %u documents, %u mutations each, %u backends: OK\n", documents, MUTATIONS, count);
+	result = OK;
+cleanup:
+	chosen = NULL;
+	json_tokens_free(&base);
+	json_tokens_free(&got);
+	json_tokens_free(&want);
+	buffer_free(&text);
+	return result;
+}
+
+static int gen_feed(buffer_t *text)
+{
+	char entry[1024];
+	unsigned i;
+	if (buffer_append(text, "{\"result\": \"ok\", \"data\": ["))
+		return ERROR;
+	for (i = 0; i < FEED_CHAPTERS; ++i) {
+		sprintf(entry, "%s{\"id\": \"%08u-1111-2222-3333-444444444444\", \"type\": \"chapter\", "
+		        "\"attributes\": {\"volume\": \"%u\", \"chapter\": \"%u\", "
+		        "\"title\": \"Chapter title number %u with \\\"quotes\\\" \\u00e9\", "
+		        "\"translatedLanguage\": \"en\", \"externalUrl\": null, "
+		        "\"publishAt\": \"2020-01-01T00:00:00+00:00\", \"pages\": 20, \"version\": 1}, "
+		        "\"relationships\": [{\"id\": \"%08u-aaaa-bbbb-cccc-dddddddddddd\", "
+		        "\"type\": \"scanlation_group\", \"attributes\": {\"name\": \"Group %u\"}}, "
+		        "{\"id\": \"eeee\", \"type\": \"manga\"}, {\"id\": \"ffff\", \"type\": \"user\"}]}",
+		        i ? ", " : "", i, i / 10, i, i, i % 7, i % 7);
+		if (buffer_append(text, entry))
+			return ERROR;
+	}
+	return buffer_append(text, "], \"limit\": 500, \"offset\": 0, \"total\": 500}");
+}
+
+static int bench(void)
+{
+	int result = ERROR;
+	unsigned backend, round, i, count = (unsigned)SIZEOF(backends);
+	clock_t begin, best;
+	buffer_t text = buffer_make(0);
+	json_tokens_t tokens = json_tokens_make(0);
+	while (count > 1 && backends[count - 1] != pick())
+		--count;
+	if (gen_feed(&text))
+		goto cleanup;
+	printf("json: %lu byte feed page, %lu byte tokens\n", (unsigned long)text.n, (unsigned long)sizeof(json_t));
+	for (backend = 0; backend < count; ++backend) {
+		chosen = backends[backend];
+		for (best = 0, round = 0; round < BENCH_ROUNDS; ++round) {
+			begin = clock();
+			for (i = 0; i < BENCH_PARSES; ++i)
+				if (!json_parse(&tokens, text.data, text.n))
+					goto cleanup;
+			if (!round || clock() - begin < best)
+				best = clock() - begin;
+		}
+		printf("json: %-6s %8.1f MB/s, %lu tokens\n", names[backend],
+		       (double)BENCH_PARSES * (double)text.n / 1e6 / ((double)(best ? best : 1) / CLOCKS_PER_SEC),
+		       (unsigned long)tokens.n);
+	}
+	result = OK;
+cleanup:
+	chosen = NULL;
+	json_tokens_free(&tokens);
+	buffer_free(&text);
+	return result;
+}
+
+int main(int argc, char **argv)
+{
+	if (argc > 1 && !strcmp(argv[1], "bench"))
+		return bench() ? EXIT_FAILURE : EXIT_SUCCESS;
+	if (argc > 1 && strcmp(argv[1], "fuzz")) {
+		puts("Usage: json [fuzz [seed [documents]] | bench]");
+		return EXIT_FAILURE;
+	}
+	return fuzz(argc > 2 ? strtoul(argv[2], NULL, 10) : 1,
+	            argc > 3 ? (unsigned)strtoul(argv[3], NULL, 10) : DOCUMENTS) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,72 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../src/util.h"
+#include "../src/http.h"
+#include "../src/spool.h"
+#include "../src/pack.h"
+
+#define PAGE_SIZE (4 << 20)
+#define PAGE_WAIT 2500
+#define MAX_POLLS 10
+
+static int fill(spool_t *spool)
+{
+	char chunk[4096];
+	size_t i, n;
+	http_sink_t sink = spool_sink(spool);
+	memcpy(chunk, "\x89PNG", 4);
+	for (i = 4; i < sizeof(chunk); ++i)
+		chunk[i] = (char)(i % 64);
+	for (n = 0; n < PAGE_SIZE; n += sizeof(chunk)) {
+		if (sink.write(sink.data, chunk, sizeof(chunk)) != sizeof(chunk))
+			return ERROR;
+		memset(chunk, 'x', 4);
+	}
+	return OK;
+}
+
+static int finish_idle(void)
+{
+	int result = ERROR;
+	unsigned polls = 0;
+	long until;
+	spool_t spool;
+	pack_job_t job;
+	memset(&spool, 0, sizeof(spool));
+	memset(&job, 0, sizeof(job));
+	if (spool_open(&spool, NULL, NULL) || fill(&spool) ||
+	    pack_submit(&job, &spool, pack_level(&spool)))
+		goto cleanup;
+	for (until = mclock() + PAGE_WAIT; mclock() < until; ++polls)
+		if (http_poll())
+			goto cleanup;
+	if (polls > MAX_POLLS) {
+		printf("pack: %u polls while the head page was pending\n", polls);
+		goto cleanup;
+	}
+	if (!pack_done(&job) || job.result || job.out.size >= spool.size) {
+		puts("pack: deflate job did not finish");
+		goto cleanup;
+	}
+	printf("pack: job finished during %u polls: OK\n", polls);
+	result = OK;
+cleanup:
+	pack_cancel(&job);
+	spool_close(&spool);
+	return result;
+}
+
+int main(void)
+{
+	int result;
+	http_args_t args;
+	memset(&args, 0, sizeof(args));
+	args.flags = HTTP_NOCACHE;
+	if (http_init(&args) || pack_init("png=6", 1))
+		return EXIT_FAILURE;
+	result = finish_idle();
+	pack_free();
+	http_free();
+	return result ? EXIT_FAILURE : EXIT_SUCCESS;
+}